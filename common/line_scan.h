@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Line scanning and storage shared by the dedup tools of lab1 and lab2.
+//
+// With SSE2 the scanner compares 64
+// bytes at a time against '\n' and walks the resulting bit mask, so a block
+// full of short lines costs four compares instead of one memchr call per
+// line. The tail, and builds without SSE2, fall back to memchr.
+
+// Calls f(line, length) for every newline-terminated line in
+// [data, data + size), without the newline. Returns the start of the
+// unterminated tail, which is data + size when the range ends in a newline.
+template <typename F>
+const char* scan_lines(const char* data, size_t size, F&& f) {
+    const char* line = data;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 64 <= size; i += 64) {
+        uint64_t mask = 0;
+        for (int k = 0; k < 4; ++k) {
+            __m128i bytes = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(data + i + 16 * k));
+            uint32_t bits = static_cast<uint32_t>(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+            mask |= static_cast<uint64_t>(bits) << (16 * k);
+        }
+        while (mask != 0) {
+            const char* end = data + i + __builtin_ctzll(mask);
+            f(line, static_cast<size_t>(end - line));
+            line = end + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    const char* end = data + size;
+    const char* p = data + i;
+    while (p < end) {
+        const char* newline_at =
+                static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (newline_at == nullptr) {
+            break;
+        }
+        f(line, static_cast<size_t>(newline_at - line));
+        line = newline_at + 1;
+        p = line;
+    }
+    return line;
+}
+
+const size_t LINE_ARENA_BLOCK_SIZE = 1024 * 1024;
+
+// Append-only storage for streamed lines. Lines are packed into large
+// blocks; a block is never reallocated, so views into it stay valid.
+class LineArena {
+public:
+    std::string_view store(const char* data, size_t size) {
+        if (blocks_.empty() || capacity_ - used_ < size) {
+            capacity_ = std::max(LINE_ARENA_BLOCK_SIZE, size);
+            blocks_.push_back(std::make_unique<char[]>(capacity_));
+            used_ = 0;
+        }
+        char* target = blocks_.back().get() + used_;
+        std::memcpy(target, data, size);
+        used_ += size;
+        return std::string_view(target, size);
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Line writer for the dedup output. Lines are packed into one large buffer
+// that goes out with a single write() when it is full. A line too long to
+// be worth copying is sent together with the buffer by one writev() instead.
+
+const size_t BLOCK_WRITER_SIZE = 1024 * 1024;
+
+class BlockWriter {
+public:
+    explicit BlockWriter(const std::string& filename,
+                         size_t block_size = BLOCK_WRITER_SIZE)
+            : filename_(filename),
+              block_size_(block_size),
+              buffer_(std::make_unique<char[]>(block_size)) {
+        fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ == -1) {
+            std::cerr << "Error opening file for writing: " << filename << " - "
+                      << strerror(errno) << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+    }
+
+    ~BlockWriter() {
+        if (fd_ != -1) {
+            try {
+                close();
+            } catch (const std::exception&) {
+            }
+        }
+    }
+
+    BlockWriter(const BlockWriter&) = delete;
+    BlockWriter& operator=(const BlockWriter&) = delete;
+
+    // Writes the line followed by a newline.
+    void write_line(std::string_view line) {
+        if (line.size() + 1 <= block_size_ - used_) {
+            std::memcpy(buffer_.get() + used_, line.data(), line.size());
+            used_ += line.size();
+            buffer_[used_++] = '\n';
+            return;
+        }
+        if (line.size() >= block_size_ / 2) {
+            static const char newline = '\n';
+            struct iovec parts[3] = {{buffer_.get(), used_},
+                                     {const_cast<char*>(line.data()), line.size()},
+                                     {const_cast<char*>(&newline), 1}};
+            write_all(parts, 3);
+            used_ = 0;
+            return;
+        }
+        flush();
+        write_line(line);
+    }
+
+    void flush() {
+        struct iovec part = {buffer_.get(), used_};
+        write_all(&part, 1);
+        used_ = 0;
+    }
+
+    // Flushes and closes the file; errors are thrown, unlike in the
+    // destructor.
+    void close() {
+        flush();
+        int fd = fd_;
+        fd_ = -1;
+        if (::close(fd) == -1) {
+            std::cerr << "Error closing file: " << filename_ << " - " << strerror(errno)
+                      << std::endl;
+            throw std::runtime_error("Error closing file");
+        }
+    }
+
+private:
+    // writev() until every byte is out, resuming after short writes.
+    void write_all(struct iovec* parts, int count) {
+        while (count > 0) {
+            if (parts->iov_len == 0) {
+                ++parts;
+                --count;
+                continue;
+            }
+            ssize_t written = count == 1 ? ::write(fd_, parts->iov_base, parts->iov_len)
+                                         : ::writev(fd_, parts, count);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error writing to file: " << filename_ << " - "
+                          << strerror(errno) << std::endl;
+                throw std::runtime_error("Error writing to file");
+            }
+            size_t left = static_cast<size_t>(written);
+            while (count > 0 && left >= parts->iov_len) {
+                left -= parts->iov_len;
+                ++parts;
+                --count;
+            }
+            if (count > 0) {
+                parts->iov_base = static_cast<char*>(parts->iov_base) + left;
+                parts->iov_len -= left;
+            }
+        }
+    }
+
+    std::string filename_;
+    size_t block_size_;
+    std::unique_ptr<char[]> buffer_;
+    size_t used_ = 0;
+    int fd_ = -1;
+};
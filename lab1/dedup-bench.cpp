@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "dedup_engine.h"
+#include "flat_hash_set.h"
+
+// Benchmark for the dedup hot loop: inserts the same stream of lines into
+// std::unordered_set<std::string> (what dedup used to do), into a
+// FlatLineSet that starts empty and grows, and into a FlatLineSet sized
+// from the line count up front. Lines are drawn from a pool of distinct
+// random strings, so --unique sets the share of distinct lines.
+
+struct BenchLines {
+    std::string pool;               // distinct lines, back to back
+    size_t line_length = 0;
+    std::vector<uint32_t> picks;    // input order, as indices into the pool
+
+    std::string_view line(size_t i) const {
+        return std::string_view(pool.data() + picks[i] * line_length, line_length);
+    }
+};
+
+BenchLines make_lines(size_t lines, size_t unique_percent, size_t line_length,
+                      uint64_t seed) {
+    static const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::mt19937_64 generator(seed);
+    BenchLines result;
+    result.line_length = line_length;
+    size_t distinct = std::max<size_t>(1, lines * unique_percent / 100);
+    result.pool.resize(distinct * line_length);
+    for (char& c : result.pool) {
+        c = charset[generator() % (sizeof(charset) - 1)];
+    }
+    // Every pooled line appears at least once, the rest are repeats.
+    result.picks.resize(lines);
+    for (size_t i = 0; i < lines; ++i) {
+        result.picks[i] = static_cast<uint32_t>(i < distinct ? i : generator() % distinct);
+    }
+    std::shuffle(result.picks.begin(), result.picks.end(), generator);
+    return result;
+}
+
+template <typename F>
+double best_seconds(size_t iterations, size_t& unique, F run) {
+    double best = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        unique = run();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        if (i == 0 || duration.count() < best) {
+            best = duration.count();
+        }
+    }
+    return best;
+}
+
+bool parse_flag(const std::string& arg, const std::string& name,
+                std::string& value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+void print_usage() {
+    std::cerr << "Usage: dedup-bench [--sizes=LINES,...] [--unique=PERCENT]"
+                 " [--line-length=N] [--iterations=N] [--seed=N]"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes = {10000, 10000000, 100000000};
+    size_t unique_percent = 50;
+    size_t line_length = 16;
+    size_t iterations = 3;
+    uint64_t seed = 1;
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        std::string value;
+        if (parse_flag(arg, "sizes", value)) {
+            sizes.clear();
+            std::stringstream stream(value);
+            std::string item;
+            while (std::getline(stream, item, ',')) {
+                sizes.push_back(std::stoul(item));
+            }
+        } else if (parse_flag(arg, "unique", value)) {
+            unique_percent = std::min<size_t>(100, std::stoul(value));
+        } else if (parse_flag(arg, "line-length", value)) {
+            line_length = std::max<size_t>(1, std::stoul(value));
+        } else if (parse_flag(arg, "iterations", value)) {
+            iterations = std::max<size_t>(1, std::stoul(value));
+        } else if (parse_flag(arg, "seed", value)) {
+            seed = std::stoull(value);
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (sizes.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (size_t lines : sizes) {
+        BenchLines input = make_lines(lines, unique_percent, line_length, seed);
+        std::cout << "lines " << lines << ", " << unique_percent << "% unique, length "
+                  << line_length << ":" << std::endl;
+
+        size_t expected = 0;
+        double node_seconds = best_seconds(iterations, expected, [&] {
+            std::unordered_set<std::string> set;
+            for (size_t i = 0; i < lines; ++i) {
+                set.insert(std::string(input.line(i)));
+            }
+            return set.size();
+        });
+
+        size_t grown_unique = 0;
+        double grown_seconds = best_seconds(iterations, grown_unique, [&] {
+            FlatLineSet set;
+            for (size_t i = 0; i < lines; ++i) {
+                std::string_view line = input.line(i);
+                set.insert(hash_line(line.data(), line.size()), line);
+            }
+            return set.size();
+        });
+
+        size_t sized_unique = 0;
+        double sized_seconds = best_seconds(iterations, sized_unique, [&] {
+            FlatLineSet set(lines);
+            for (size_t i = 0; i < lines; ++i) {
+                std::string_view line = input.line(i);
+                set.insert(hash_line(line.data(), line.size()), line);
+            }
+            return set.size();
+        });
+
+        if (grown_unique != expected || sized_unique != expected) {
+            std::cerr << "Unique line counts differ: " << expected << ", "
+                      << grown_unique << ", " << sized_unique << std::endl;
+            return 1;
+        }
+        auto report = [&](const char* name, double seconds) {
+            std::cout << "  " << std::setw(24) << name << ": " << seconds << " s, "
+                      << lines / 1e6 / std::max(seconds, 1e-9) << " Mlines/s, "
+                      << node_seconds / std::max(seconds, 1e-9) << "x" << std::endl;
+        };
+        report("unordered_set<string>", node_seconds);
+        report("FlatLineSet (growing)", grown_seconds);
+        report("FlatLineSet (presized)", sized_seconds);
+        std::cout << "  unique " << expected << std::endl;
+    }
+    return 0;
+}
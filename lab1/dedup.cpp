@@ -1,10 +1,13 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <random>
 #include <string>
-#include <unordered_set>
+
+#include "dedup_engine.h"
 
 std::string generateRandomString(size_t length) {
     static std::mt19937 generator(std::random_device{}());
@@ -32,9 +35,28 @@ void createInputFile(const std::string& filename, int num_lines,
     file.close();
 }
 
+// Matches "--name=value" and stores the value part.
+bool parse_flag(const std::string& arg, const std::string& name,
+                std::string& value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+void print_usage() {
+    std::cerr << "Usage: dedup <num_iterations> [--threads=N] [--shards=N]"
+                 " [--mmap] [--ordered] [--mem-limit=MB] [--count-distinct[=PRECISION]]"
+                 " [--bloom=FP_RATE] [--expected=N] [--index=PATH] [--input=FILE] [--output=FILE]"
+                 " [--lines=N] [--line-length=N]"
+              << std::endl;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: dedup <num_iterations>" << std::endl;
+    if (argc < 2) {
+        print_usage();
         return 1;
     }
 
@@ -43,45 +65,144 @@ int main(int argc, char* argv[]) {
     int line_length = 50;
     std::string input_filename = "input.txt";
     std::string output_filename = "output.txt";
+    // An existing --input file is deduplicated as is instead of a generated one.
+    bool generate = true;
+    DedupOptions options;
+    // Approximate modes: a HyperLogLog count, or a Bloom filter that passes
+    // only lines it has not seen.
+    bool count_distinct = false;
+    unsigned precision = HLL_DEFAULT_PRECISION;
+    double bloom_fp_rate = 0;
+    size_t expected_lines = 0;
+    // Persistent index: only lines no earlier run has seen are written.
+    std::string index_path;
+    for (int a = 2; a < argc; ++a) {
+        std::string arg = argv[a];
+        std::string value;
+        if (arg == "--mmap") {
+            options.mmap = true;
+        } else if (arg == "--ordered") {
+            options.ordered = true;
+        } else if (arg == "--count-distinct") {
+            count_distinct = true;
+        } else if (parse_flag(arg, "count-distinct", value)) {
+            count_distinct = true;
+            precision = static_cast<unsigned>(std::stoul(value));
+        } else if (parse_flag(arg, "bloom", value)) {
+            bloom_fp_rate = std::stod(value);
+        } else if (parse_flag(arg, "expected", value)) {
+            expected_lines = std::stoul(value);
+        } else if (parse_flag(arg, "index", value)) {
+            index_path = value;
+        } else if (parse_flag(arg, "threads", value)) {
+            options.threads = static_cast<unsigned>(std::max(1, std::stoi(value)));
+        } else if (parse_flag(arg, "shards", value)) {
+            options.shards = std::max<size_t>(1, std::stoul(value));
+        } else if (parse_flag(arg, "mem-limit", value)) {
+            options.mem_limit = std::stoul(value) * 1024 * 1024;
+        } else if (parse_flag(arg, "input", value)) {
+            input_filename = value;
+            generate = false;
+        } else if (parse_flag(arg, "output", value)) {
+            output_filename = value;
+        } else if (parse_flag(arg, "lines", value)) {
+            num_lines = std::stoi(value);
+        } else if (parse_flag(arg, "line-length", value)) {
+            line_length = std::stoi(value);
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    int modes = count_distinct + (bloom_fp_rate > 0) + !index_path.empty();
+    if (modes > 1 || bloom_fp_rate < 0 ||
+        bloom_fp_rate >= 1 || precision < HLL_MIN_PRECISION ||
+        precision > HLL_MAX_PRECISION) {
+        print_usage();
+        return 1;
+    }
 
     std::cout << "Starting dedup with " << num_iterations
               << " iterations and file: " << input_filename << std::endl;
 
     for (int i = 0; i < num_iterations; ++i) {
-        createInputFile(input_filename, num_lines, line_length);
-
-        std::unordered_set<std::string> unique_lines;
+        if (generate) {
+            createInputFile(input_filename, num_lines, line_length);
+        }
 
         auto start = std::chrono::high_resolution_clock::now();
-
-        std::ifstream file(input_filename);
-        if (!file.is_open()) {
-            std::cerr << "Error opening file for reading: " << input_filename
-                      << std::endl;
-            return 1;
+        if (!index_path.empty()) {
+            try {
+                FingerprintIndex index(index_path);
+                IncrementalStats stats =
+                        incremental_dedup_file(input_filename, output_filename, options,
+                                               index);
+                std::chrono::duration<double> duration =
+                        std::chrono::high_resolution_clock::now() - start;
+                std::cout << "Iteration " << i + 1 << ": Deduped " << stats.lines
+                          << " lines (" << stats.added << " new, index "
+                          << stats.index_size << ") in " << std::fixed
+                          << std::setprecision(7) << duration.count() << " seconds"
+                          << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            continue;
         }
-
-        std::string line;
-        while (std::getline(file, line)) {
-            unique_lines.insert(line);
+        if (count_distinct || bloom_fp_rate > 0) {
+            try {
+                if (count_distinct) {
+                    DistinctEstimate estimate =
+                            count_distinct_file(input_filename, options, precision);
+                    std::chrono::duration<double> duration =
+                            std::chrono::high_resolution_clock::now() - start;
+                    std::cout << "Iteration " << i + 1 << ": Counted ~"
+                              << std::llround(estimate.distinct)
+                              << " distinct lines (error " << std::fixed
+                              << std::setprecision(2)
+                              << estimate.standard_error * 100 << "%) in "
+                              << estimate.lines << " lines in "
+                              << std::setprecision(7) << duration.count()
+                              << " seconds" << std::endl;
+                } else {
+                    BloomStats stats = bloom_filter_file(input_filename, output_filename,
+                                                         options, bloom_fp_rate,
+                                                         expected_lines);
+                    std::chrono::duration<double> duration =
+                            std::chrono::high_resolution_clock::now() - start;
+                    std::cout << "Iteration " << i + 1 << ": Filtered " << stats.lines
+                              << " lines (" << stats.passed << " probably new) in "
+                              << std::fixed << std::setprecision(7)
+                              << duration.count() << " seconds, filter "
+                              << std::setprecision(2)
+                              << stats.filter_bytes / (1024.0 * 1024.0) << " MB, "
+                              << stats.hashes << " hashes" << std::endl;
+                }
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 1;
+            }
+            continue;
         }
-        file.close();
 
-        std::ofstream outfile(output_filename);
-        if (!outfile.is_open()) {
-            std::cerr << "Error opening file for writing: " << output_filename
-                      << std::endl;
+        DedupStats stats;
+        try {
+            stats = dedup_file(input_filename, output_filename, options);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
             return 1;
         }
-        for (const auto& l : unique_lines) {
-            outfile << l << std::endl;
-        }
-        outfile.close();
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> duration = end - start;
-        std::cout << "Iteration " << i + 1 << ": Deduped " << num_lines
-                  << " lines in " << std::fixed << std::setprecision(7)
-                  << duration.count() << " seconds" << std::endl;
+        std::cout << "Iteration " << i + 1 << ": Deduped " << stats.lines
+                  << " lines (" << stats.unique << " unique) in " << std::fixed
+                  << std::setprecision(7) << duration.count() << " seconds"
+                  << std::endl;
+        if (stats.partitions > 0) {
+            std::cout << "Spilled " << stats.spilled_bytes / (1024.0 * 1024.0)
+                      << " MB to " << stats.partitions << " partitions" << std::endl;
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,871 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../common/line_scan.h"
+#include "block_writer.h"
+#include "fingerprint_index.h"
+#include "flat_hash_set.h"
+#include "sketches.h"
+
+// Parallel line dedup used by dedup. The input is split at newlines into
+// one byte range per thread. Readers hash every line once and batch it to
+// the thread that owns its shard, one of `shards` FlatLineSets by hash; the
+// owner drops a repeat as soon as it arrives, so only distinct lines are
+// held. Every line remembers the position of its first occurrence, so the
+// first occurrence wins however the readers interleave. Shards are written
+// in order, each in input order, so the output depends on the shard count
+// but not on the number of threads. With `ordered`, lines are written in the order of their first
+// occurrence in the input instead.
+//
+// Lines are kept as string_views: with --mmap they point into the mapped
+// input, otherwise into a per-owner arena the streamed lines are copied
+// to when first seen, so nothing is allocated per line and repeats are
+// never stored.
+//
+// With a memory limit, inputs whose in-memory dedup would not fit are
+// hash-partitioned into spill files first (see dedup_file). When an exact
+// answer is not needed, count_distinct_file and bloom_filter_file work in
+// fixed memory instead. incremental_dedup_file keeps the lines seen across
+// runs in a persistent FingerprintIndex.
+
+const size_t DEDUP_READ_BLOCK_SIZE = 4 * 1024 * 1024;
+const size_t DEDUP_DEFAULT_SHARDS = 64;
+const size_t DEDUP_SAMPLE_SIZE = 1024 * 1024;
+const size_t DEDUP_SPILL_BUFFER_SIZE = 1024 * 1024;
+// A reader hands lines to a shard owner in batches of up to this many lines
+// or bytes, and waits once an owner has this many batches per reader queued.
+const size_t DEDUP_BATCH_LINES = 1024;
+const size_t DEDUP_BATCH_BYTES = 64 * 1024;
+const size_t DEDUP_QUEUE_BATCHES_PER_READER = 2;
+// Bytes per distinct line on top of the line itself: its slot in the
+// shard's set and its entry in the sorted shard. Memory is estimated from
+// the line count, as if every line were distinct.
+const size_t DEDUP_LINE_OVERHEAD = 64;
+
+struct DedupOptions {
+    unsigned threads = 1;
+    size_t shards = DEDUP_DEFAULT_SHARDS;
+    bool mmap = false;  // map the input instead of streaming it
+    size_t mem_limit = 0;  // bytes, 0 for no limit; above it lines are spilled
+    bool ordered = false;  // first-occurrence order instead of shard order
+};
+
+struct DedupStats {
+    size_t lines = 0;
+    size_t unique = 0;
+    size_t partitions = 0;  // spill partitions, 0 when deduplicated in memory
+    size_t spilled_bytes = 0;
+};
+
+inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ULL;
+    x ^= x >> 32;
+    return x;
+}
+
+// 64-bit hash of a line, eight bytes per step.
+inline uint64_t hash_line(const char* data, size_t size) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = (size + 1) * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ hash_mix(word)) * multiplier;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        std::memcpy(&word, data + i, size - i);
+        hash = (hash ^ hash_mix(word)) * multiplier;
+    }
+    return hash_mix(hash);
+}
+
+// Shard of a line. Takes the high half of the hash, so the shard's own hash
+// table, which buckets by the low bits, still sees well-spread values.
+inline size_t shard_of(uint64_t hash, size_t shards) {
+    return static_cast<size_t>((hash >> 32) % shards);
+}
+
+// Read-only private mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            std::cerr << "Error opening file for reading: " << filename << " - "
+                      << strerror(errno) << std::endl;
+            if (fd != -1) {
+                ::close(fd);
+            }
+            throw std::runtime_error("Error opening file");
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                std::cerr << "Error mapping file: " << filename << " - "
+                          << strerror(errno) << std::endl;
+                ::close(fd);
+                throw std::runtime_error("Error mapping file");
+            }
+            data_ = static_cast<const char*>(data);
+            madvise(const_cast<char*>(data_), size_, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+
+    size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Offsets that split data[0, size) into `parts` ranges, each starting right
+// after a newline (or at 0).
+inline std::vector<size_t> split_at_lines(const char* data, size_t size,
+                                          unsigned parts) {
+    std::vector<size_t> bounds = {0};
+    for (unsigned part = 1; part < parts; ++part) {
+        size_t offset = std::max(bounds.back(), size * part / parts);
+        size_t bound = offset;
+        if (offset > 0 && data[offset - 1] != '\n') {
+            const void* newline = std::memchr(data + offset, '\n', size - offset);
+            bound = newline == nullptr
+                            ? size
+                            : static_cast<const char*>(newline) - data + 1;
+        }
+        bounds.push_back(bound);
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+// Offsets that split the file into `parts` ranges, each starting right
+// after a newline (or at 0). Ranges may be empty when lines are long.
+inline std::vector<size_t> split_at_lines(const std::string& filename, size_t size,
+                                          unsigned parts) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for reading: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+
+    std::vector<size_t> bounds = {0};
+    std::vector<char> buffer(64 * 1024);
+    for (unsigned part = 1; part < parts; ++part) {
+        size_t offset = std::max(bounds.back(), size * part / parts);
+        // The range owns the line that starts at `offset` only if the byte
+        // before it ends the previous line.
+        size_t scan = offset == 0 ? 0 : offset - 1;
+        size_t bound = size;
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(scan));
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            size_t count = static_cast<size_t>(file.gcount());
+            const void* newline = std::memchr(buffer.data(), '\n', count);
+            if (newline != nullptr) {
+                bound = scan + (static_cast<const char*>(newline) - buffer.data()) + 1;
+                break;
+            }
+            scan += count;
+        }
+        bounds.push_back(offset == 0 ? 0 : bound);
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+// Calls f(data, size) for every line in [begin, end) of the file, without
+// the newline. A last line without a newline is still a line. The data of a
+// line is only valid during the call.
+template <typename F>
+void for_each_line(const std::string& filename, size_t begin, size_t end, F f) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for reading: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+    file.seekg(static_cast<std::streamoff>(begin));
+
+    std::vector<char> block(DEDUP_READ_BLOCK_SIZE);
+    std::string carry;
+    size_t remaining = end - begin;
+    while (remaining > 0) {
+        size_t count = std::min(remaining, block.size());
+        if (!file.read(block.data(), count)) {
+            throw std::runtime_error("Error reading from file: " + filename);
+        }
+        remaining -= count;
+
+        const char* tail = scan_lines(block.data(), count,
+                                      [&](const char* line, size_t length) {
+                                          if (carry.empty()) {
+                                              f(line, length);
+                                              return;
+                                          }
+                                          carry.append(line, length);
+                                          f(carry.data(), carry.size());
+                                          carry.clear();
+                                      });
+        carry.append(tail, block.data() + count - tail);
+    }
+    if (!carry.empty()) {
+        f(carry.data(), carry.size());
+    }
+}
+
+// The input file split at newlines into one range per reader, either
+// mapped or streamed.
+class InputRanges {
+public:
+    InputRanges(const std::string& filename, size_t size, unsigned parts, bool mmap)
+            : filename_(filename) {
+        if (mmap) {
+            mapped_ = std::make_unique<MappedFile>(filename);
+            bounds_ = split_at_lines(mapped_->data(), mapped_->size(), parts);
+        } else {
+            bounds_ = split_at_lines(filename, size, parts);
+        }
+    }
+
+    unsigned size() const { return static_cast<unsigned>(bounds_.size() - 1); }
+
+    bool mapped() const { return mapped_ != nullptr; }
+
+    // Calls f(line, length) for every line of range t. Mapped lines stay
+    // valid until release(), streamed ones only during the call.
+    template <typename F>
+    void scan(unsigned t, F&& f) const {
+        if (mapped_) {
+            const char* begin = mapped_->data() + bounds_[t];
+            const char* end = mapped_->data() + bounds_[t + 1];
+            const char* tail = scan_lines(begin, end - begin, f);
+            if (tail < end) {
+                f(tail, static_cast<size_t>(end - tail));
+            }
+        } else {
+            for_each_line(filename_, bounds_[t], bounds_[t + 1], f);
+        }
+    }
+
+    void release() { mapped_.reset(); }
+
+private:
+    std::string filename_;
+    std::unique_ptr<MappedFile> mapped_;
+    std::vector<size_t> bounds_;
+};
+
+// Position of a line in the input: its range in the high bits, its index
+// within the range in the low ones, so positions compare in input order.
+inline uint64_t line_position(unsigned range, size_t index) {
+    return static_cast<uint64_t>(range) << 48 | index;
+}
+
+// A distinct line and the position of its first occurrence.
+struct PositionedLine {
+    uint64_t position;
+    std::string_view text;
+
+    bool operator<(const PositionedLine& other) const {
+        return position < other.position;
+    }
+};
+
+// Lines one reader hands to a shard owner: every line's hash, position and
+// length, and unless the lines are stable, their bytes packed back to back.
+struct LineBatch {
+    struct Line {
+        uint64_t hash;
+        uint64_t position;
+        const char* data;  // stable lines only
+        size_t size;
+    };
+
+    std::vector<Line> lines;
+    std::string bytes;
+
+    bool full() const {
+        return lines.size() >= DEDUP_BATCH_LINES || bytes.size() >= DEDUP_BATCH_BYTES;
+    }
+};
+
+// Bounded queue of the batches bound for one shard owner. Readers wait
+// while it is full, so the batches in flight stay within a fixed budget.
+class BatchQueue {
+public:
+    BatchQueue(size_t capacity, unsigned producers)
+            : capacity_(capacity), producers_(producers) {}
+
+    // Waits for room. Once the owner has failed, the batch is dropped.
+    void push(LineBatch batch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return batches_.size() < capacity_ || closed_; });
+        if (!closed_) {
+            batches_.push_back(std::move(batch));
+            not_empty_.notify_one();
+        }
+    }
+
+    // Called once by every producer when it has pushed its last batch.
+    void producer_done() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --producers_;
+        not_empty_.notify_one();
+    }
+
+    // The next batch; false once every producer is done and the queue is
+    // drained.
+    bool pop(LineBatch& batch) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return !batches_.empty() || producers_ == 0; });
+        if (batches_.empty()) {
+            return false;
+        }
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Called by a failed owner: drops what is queued and releases waiting
+    // producers.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        batches_.clear();
+        not_full_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<LineBatch> batches_;
+    size_t capacity_;
+    unsigned producers_;
+    bool closed_ = false;
+};
+
+// Deduplicates the lines that read(t, route) produces for every range t and
+// appends the unique ones to output. read calls route(line) for each line of
+// its range, in order. With `stable_lines` a line stays valid until
+// dedup_ranges returns (it points into a mapping); otherwise only during the
+// call, and lines are copied into the batches that carry them.
+// `expected_lines` is the estimated number of lines read; every shard's set
+// is sized for its share up front, so it does not grow while lines arrive.
+//
+// Every shard has a single owner thread, which alone touches the shard's
+// FlatLineSet, so no lock is taken per line. Readers hash each line and
+// route it into a batch for the owner of its shard; full batches go through
+// the owner's bounded BatchQueue. Owners drop a repeat as soon as it
+// arrives and copy a new streamed line to their arena, so memory grows
+// with the distinct lines only. Batches from different readers interleave,
+// so the first batch to carry a line need not hold its first occurrence:
+// every line keeps the smallest position seen for it. Each owner then
+// sorts its shards by position; shards are written in order, or with
+// `ordered` merged into one input-order stream.
+template <typename Read>
+DedupStats dedup_ranges(unsigned ranges, unsigned threads, size_t shards,
+                        size_t expected_lines, bool ordered, bool stable_lines, Read read,
+                        BlockWriter& output) {
+    unsigned owners = static_cast<unsigned>(std::min<size_t>(threads, shards));
+    std::vector<std::unique_ptr<BatchQueue>> queues;
+    for (unsigned o = 0; o < owners; ++o) {
+        queues.push_back(std::make_unique<BatchQueue>(
+                DEDUP_QUEUE_BATCHES_PER_READER * ranges, ranges));
+    }
+
+    // Shard s belongs to owner s % owners, and only that thread touches
+    // shard_sets[s] and sorted[s], or the owner's arena.
+    std::vector<FlatLineSet> shard_sets(shards);
+    std::vector<LineArena> arenas(owners);
+    std::vector<std::vector<PositionedLine>> sorted(shards);
+    std::vector<std::exception_ptr> owner_errors(owners);
+    std::vector<std::thread> owner_threads;
+    for (unsigned o = 0; o < owners; ++o) {
+        owner_threads.emplace_back([&, o] {
+            try {
+                for (size_t s = o; s < shards; s += owners) {
+                    shard_sets[s] = FlatLineSet(expected_lines / shards);
+                }
+                auto keep = [&](std::string_view line) {
+                    return stable_lines ? line
+                                        : arenas[o].store(line.data(), line.size());
+                };
+                LineBatch batch;
+                while (queues[o]->pop(batch)) {
+                    const char* bytes = batch.bytes.data();
+                    for (const LineBatch::Line& line : batch.lines) {
+                        std::string_view text(stable_lines ? line.data : bytes,
+                                              line.size);
+                        bytes += stable_lines ? 0 : line.size;
+                        bool added;
+                        uint64_t& first =
+                                shard_sets[shard_of(line.hash, shards)].find_or_insert(
+                                        line.hash, text, keep, added);
+                        if (added || line.position < first) {
+                            first = line.position;
+                        }
+                    }
+                }
+                // Each shard's lines in input order; the set is dropped once
+                // listed.
+                for (size_t s = o; s < shards; s += owners) {
+                    FlatLineSet lines = std::move(shard_sets[s]);
+                    sorted[s].reserve(lines.size());
+                    lines.for_each([&](std::string_view text, uint64_t position) {
+                        sorted[s].push_back({position, text});
+                    });
+                    std::sort(sorted[s].begin(), sorted[s].end());
+                }
+            } catch (...) {
+                owner_errors[o] = std::current_exception();
+                queues[o]->close();
+            }
+        });
+    }
+
+    std::vector<size_t> range_lines(ranges);
+    std::vector<std::exception_ptr> errors(ranges);
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < ranges; ++t) {
+        readers.emplace_back([&, t] {
+            std::vector<LineBatch> batches(owners);
+            try {
+                read(t, [&](std::string_view line) {
+                    uint64_t hash = hash_line(line.data(), line.size());
+                    unsigned o = static_cast<unsigned>(shard_of(hash, shards) % owners);
+                    LineBatch& batch = batches[o];
+                    batch.lines.push_back({hash, line_position(t, range_lines[t]++),
+                                           line.data(), line.size()});
+                    if (!stable_lines) {
+                        batch.bytes.append(line.data(), line.size());
+                    }
+                    if (batch.full()) {
+                        queues[o]->push(std::move(batch));
+                        batch = LineBatch();
+                    }
+                });
+                for (unsigned o = 0; o < owners; ++o) {
+                    if (!batches[o].lines.empty()) {
+                        queues[o]->push(std::move(batches[o]));
+                    }
+                }
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+            for (auto& queue : queues) {
+                queue->producer_done();
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    for (auto& owner : owner_threads) {
+        owner.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    for (const auto& error : owner_errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    DedupStats stats;
+    for (unsigned t = 0; t < ranges; ++t) {
+        stats.lines += range_lines[t];
+    }
+    for (const auto& lines : sorted) {
+        stats.unique += lines.size();
+    }
+    if (!ordered) {
+        for (const auto& lines : sorted) {
+            for (const PositionedLine& line : lines) {
+                output.write_line(line.text);
+            }
+        }
+        return stats;
+    }
+
+    // Heap of the next line of every shard, smallest position on top.
+    std::vector<size_t> next(shards);
+    std::priority_queue<std::pair<PositionedLine, size_t>,
+                        std::vector<std::pair<PositionedLine, size_t>>,
+                        std::greater<>>
+            heads;
+    for (size_t s = 0; s < shards; ++s) {
+        if (!sorted[s].empty()) {
+            heads.push({sorted[s][next[s]++], s});
+        }
+    }
+    while (!heads.empty()) {
+        auto [line, s] = heads.top();
+        heads.pop();
+        output.write_line(line.text);
+        if (next[s] < sorted[s].size()) {
+            heads.push({sorted[s][next[s]++], s});
+        }
+    }
+    return stats;
+}
+
+// Line count of the file, extrapolated from its first DEDUP_SAMPLE_SIZE
+// bytes.
+inline size_t estimate_line_count(const std::string& filename, size_t size) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for reading: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+    std::vector<char> sample(std::min(size, DEDUP_SAMPLE_SIZE));
+    file.read(sample.data(), sample.size());
+    size_t sample_lines = std::max<size_t>(
+            1, std::count(sample.begin(), sample.end(), '\n'));
+    return size / std::max<size_t>(1, sample.size() / sample_lines) + 1;
+}
+
+// Rough peak memory of deduplicating a file in memory: the lines themselves
+// plus DEDUP_LINE_OVERHEAD per line.
+inline size_t estimate_dedup_bytes(size_t size, size_t lines) {
+    return size + lines * DEDUP_LINE_OVERHEAD;
+}
+
+// Spill partition of a line. Remixes the hash, so the partition is
+// independent of the shard and of the bits the shard's set probes with.
+inline size_t partition_of(uint64_t hash, size_t partitions) {
+    return static_cast<size_t>((hash_mix(hash ^ 0x9e3779b97f4a7c15ULL) >> 32) %
+                               partitions);
+}
+
+inline std::string partition_filename(unsigned range, size_t partition) {
+    return "temp_dedup_" + std::to_string(range) + "_" + std::to_string(partition) +
+           ".tmp";
+}
+
+// One reader's spill files, one per partition. Lines are buffered per
+// partition and appended in batches; a file is only open while its buffer
+// is flushed, so readers x partitions never runs into the fd limit.
+class PartitionWriter {
+public:
+    PartitionWriter(unsigned range, size_t partitions, size_t buffer_size)
+            : range_(range), buffer_size_(buffer_size), buffers_(partitions) {
+        for (size_t p = 0; p < partitions; ++p) {
+            open(p, std::ios::trunc);
+        }
+    }
+
+    void add(size_t partition, std::string_view line) {
+        std::string& buffer = buffers_[partition];
+        buffer.append(line.data(), line.size());
+        buffer += '\n';
+        if (buffer.size() >= buffer_size_) {
+            flush(partition);
+        }
+    }
+
+    void flush() {
+        for (size_t p = 0; p < buffers_.size(); ++p) {
+            flush(p);
+        }
+    }
+
+    size_t bytes() const { return bytes_; }
+
+private:
+    std::ofstream open(size_t partition, std::ios::openmode mode) {
+        std::string filename = partition_filename(range_, partition);
+        std::ofstream file(filename, std::ios::binary | mode);
+        if (!file.is_open()) {
+            std::cerr << "Error opening file for writing: " << filename << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        return file;
+    }
+
+    void flush(size_t partition) {
+        std::string& buffer = buffers_[partition];
+        if (buffer.empty()) {
+            return;
+        }
+        std::ofstream file = open(partition, std::ios::app);
+        if (!file.write(buffer.data(), buffer.size())) {
+            throw std::runtime_error("Error writing to file: " +
+                                     partition_filename(range_, partition));
+        }
+        bytes_ += buffer.size();
+        buffer.clear();
+    }
+
+    unsigned range_;
+    size_t buffer_size_;
+    std::vector<std::string> buffers_;
+    size_t bytes_ = 0;
+};
+
+// Deduplicates the lines of input_filename into output_filename, one line
+// per output line. When the estimated memory use exceeds options.mem_limit,
+// the lines are first hash-partitioned into spill files that each fit the
+// budget; equal lines always share a partition, so every partition is then
+// deduplicated in memory on its own, in partition order. First occurrence
+// still wins within a partition, and the output does not depend on the
+// number of threads. Ordered output needs every distinct line in memory.
+inline DedupStats dedup_file(const std::string& input_filename,
+                             const std::string& output_filename,
+                             const DedupOptions& options) {
+    unsigned threads = std::max(1u, options.threads);
+    size_t shards = std::max<size_t>(1, options.shards);
+    size_t size = std::filesystem::file_size(input_filename);
+    size_t lines = estimate_line_count(input_filename, size);
+    size_t partitions = 1;
+    if (options.mem_limit > 0) {
+        size_t estimate = estimate_dedup_bytes(size, lines);
+        partitions = (estimate + options.mem_limit - 1) / options.mem_limit;
+    }
+
+    InputRanges input(input_filename, size, threads, options.mmap);
+    auto read_input = [&](unsigned t, auto&& f) {
+        input.scan(t, [&](const char* line, size_t length) {
+            f(std::string_view(line, length));
+        });
+    };
+
+    if (partitions > 1 && options.ordered) {
+        std::cerr << "Ordered output needs every distinct line in memory, "
+                     "raise the memory limit" << std::endl;
+        throw std::runtime_error("Ordered output does not fit the memory limit");
+    }
+    BlockWriter output(output_filename);
+    if (partitions <= 1) {
+        DedupStats stats = dedup_ranges(threads, threads, shards, lines,
+                                        options.ordered, input.mapped(), read_input,
+                                        output);
+        output.close();
+        return stats;
+    }
+
+    // Pass 1: every reader appends its lines to its own file of each
+    // partition, so a partition read back range by range is in input order.
+    size_t buffer_size = std::clamp<size_t>(
+            options.mem_limit / (4 * threads * partitions), 4096,
+            DEDUP_SPILL_BUFFER_SIZE);
+    std::vector<size_t> spilled(threads);
+    std::vector<std::thread> readers;
+    std::vector<std::exception_ptr> errors(threads);
+    for (unsigned t = 0; t < threads; ++t) {
+        readers.emplace_back([&, t] {
+            try {
+                PartitionWriter writer(t, partitions, buffer_size);
+                input.scan(t, [&](const char* line, size_t length) {
+                    uint64_t hash = hash_line(line, length);
+                    writer.add(partition_of(hash, partitions),
+                               std::string_view(line, length));
+                });
+                writer.flush();
+                spilled[t] = writer.bytes();
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    input.release();
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Pass 2: one partition at a time, its range files read in parallel.
+    DedupStats stats;
+    stats.partitions = partitions;
+    for (size_t bytes : spilled) {
+        stats.spilled_bytes += bytes;
+    }
+    for (size_t p = 0; p < partitions; ++p) {
+        DedupStats partition_stats = dedup_ranges(
+                threads, threads, shards, lines / partitions, false, false,
+                [&](unsigned t, auto&& f) {
+                    std::string filename = partition_filename(t, p);
+                    for_each_line(filename, 0, std::filesystem::file_size(filename),
+                                  [&](const char* line, size_t length) {
+                                      f(std::string_view(line, length));
+                                  });
+                    remove(filename.c_str());
+                },
+                output);
+        stats.lines += partition_stats.lines;
+        stats.unique += partition_stats.unique;
+    }
+    output.close();
+    return stats;
+}
+
+struct DistinctEstimate {
+    size_t lines = 0;
+    double distinct = 0;
+    double standard_error = 0;  // relative
+};
+
+// Estimates the number of distinct lines without storing any: every reader
+// feeds its range into its own HyperLogLog, and the sketches are merged.
+inline DistinctEstimate count_distinct_file(const std::string& input_filename,
+                                            const DedupOptions& options,
+                                            unsigned precision = HLL_DEFAULT_PRECISION) {
+    unsigned threads = std::max(1u, options.threads);
+    size_t size = std::filesystem::file_size(input_filename);
+    InputRanges input(input_filename, size, threads, options.mmap);
+
+    std::vector<HyperLogLog> sketches(threads, HyperLogLog(precision));
+    std::vector<size_t> lines(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < threads; ++t) {
+        readers.emplace_back([&, t] {
+            try {
+                input.scan(t, [&](const char* line, size_t length) {
+                    sketches[t].add(hash_line(line, length));
+                    ++lines[t];
+                });
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    DistinctEstimate estimate;
+    for (unsigned t = 0; t < threads; ++t) {
+        if (t > 0) {
+            sketches[0].merge(sketches[t]);
+        }
+        estimate.lines += lines[t];
+    }
+    estimate.distinct = estimate.lines == 0 ? 0 : sketches[0].estimate();
+    estimate.standard_error = sketches[0].standard_error();
+    return estimate;
+}
+
+struct BloomStats {
+    size_t lines = 0;
+    size_t passed = 0;
+    size_t filter_bytes = 0;
+    unsigned hashes = 0;
+};
+
+// Streams the lines of input_filename to output_filename, dropping every
+// line the Bloom filter has already seen. The output is the first
+// occurrences in input order, minus about fp_rate of the new lines, which
+// look like repeats. The filter is sized for expected_lines distinct lines,
+// or for the estimated line count of the input when that is 0.
+inline BloomStats bloom_filter_file(const std::string& input_filename,
+                                    const std::string& output_filename,
+                                    const DedupOptions& options, double fp_rate,
+                                    size_t expected_lines = 0) {
+    size_t size = std::filesystem::file_size(input_filename);
+    if (expected_lines == 0) {
+        expected_lines = estimate_line_count(input_filename, size);
+    }
+    BloomFilter filter(expected_lines, fp_rate);
+    InputRanges input(input_filename, size, 1, options.mmap);
+
+    BlockWriter output(output_filename);
+    BloomStats stats;
+    stats.filter_bytes = filter.bytes();
+    stats.hashes = filter.hashes();
+    input.scan(0, [&](const char* line, size_t length) {
+        ++stats.lines;
+        if (filter.add(hash_line(line, length))) {
+            output.write_line(std::string_view(line, length));
+            ++stats.passed;
+        }
+    });
+    output.close();
+    return stats;
+}
+
+struct IncrementalStats {
+    size_t lines = 0;
+    size_t added = 0;
+    size_t index_size = 0;
+};
+
+// Writes the lines of input_filename that the index has never seen to
+// output_filename, in input order, and saves them to the index. The output
+// is complete before the index is saved, so a failed run adds nothing.
+inline IncrementalStats incremental_dedup_file(const std::string& input_filename,
+                                               const std::string& output_filename,
+                                               const DedupOptions& options,
+                                               FingerprintIndex& index) {
+    size_t size = std::filesystem::file_size(input_filename);
+    InputRanges input(input_filename, size, 1, options.mmap);
+    BlockWriter output(output_filename);
+    IncrementalStats stats;
+    input.scan(0, [&](const char* line, size_t length) {
+        ++stats.lines;
+        if (index.insert(fingerprint_of(hash_line(line, length)))) {
+            output.write_line(std::string_view(line, length));
+            ++stats.added;
+        }
+    });
+    output.close();
+    index.save();
+    stats.index_size = index.size();
+    return stats;
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Direct I/O backend for ema-sort-int's temp runs. Files are opened with
+// O_DIRECT so run data bypasses the page cache, and every file keeps up to
+// AIO_QUEUE_DEPTH aligned blocks in flight through Linux native AIO: the
+// writer fills one block while the previous ones are being written, the
+// reader prefetches the blocks after the one being consumed.
+//
+// Native AIO is what libaio wraps; its four syscalls are called directly so
+// no library is needed. On an O_DIRECT file io_submit only queues the
+// requests and the device works on all of them at once, with no helper
+// threads and one descriptor per file.
+//
+// Block buffers are mapped with mmap rather than taken from malloc: they are
+// page aligned as O_DIRECT wants, and unmapping them returns the memory at
+// once instead of leaving it in a worker thread's malloc arena.
+//
+// File systems that refuse O_DIRECT (tmpfs) fall back to the page cache, with
+// each finished block dropped from the cache via posix_fadvise. io_submit
+// then does the I/O before it returns.
+
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+const size_t AIO_QUEUE_DEPTH = 4;
+
+// Largest multiple of both the O_DIRECT alignment and the element size that
+// fits in `target` bytes, but at least one such unit.
+inline size_t direct_block_size(size_t element_size, size_t target) {
+    size_t unit = std::lcm(DIRECT_IO_ALIGNMENT, element_size);
+    return std::max<size_t>(1, target / unit) * unit;
+}
+
+// Number of blocks a file with `buffer_size` bytes of buffer keeps in flight:
+// AIO_QUEUE_DEPTH when each still gets a whole aligned unit, fewer otherwise.
+inline size_t direct_queue_depth(size_t element_size, size_t buffer_size) {
+    size_t unit = std::lcm(DIRECT_IO_ALIGNMENT, element_size);
+    return std::clamp<size_t>(buffer_size / unit, 1, AIO_QUEUE_DEPTH);
+}
+
+// Number of files that can still get an AIO context of AIO_QUEUE_DEPTH
+// requests: the kernel caps the requests of all contexts at fs.aio-max-nr.
+inline size_t direct_file_limit() {
+    std::ifstream max_file("/proc/sys/fs/aio-max-nr");
+    std::ifstream used_file("/proc/sys/fs/aio-nr");
+    size_t max_requests = 0;
+    size_t used = 0;
+    if (!(max_file >> max_requests) || !(used_file >> used)) {
+        return std::numeric_limits<size_t>::max();
+    }
+    return max_requests > used ? (max_requests - used) / AIO_QUEUE_DEPTH : 0;
+}
+
+// One aligned buffer with the AIO request that reads or writes it. Blocks are
+// heap-allocated and never move while a request is pending.
+struct AsyncBlock {
+    explicit AsyncBlock(size_t size) : size(size) {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        data = static_cast<char*>(memory);
+        std::memset(&request, 0, sizeof(request));
+    }
+
+    ~AsyncBlock() { munmap(data, size); }
+
+    AsyncBlock(const AsyncBlock&) = delete;
+    AsyncBlock& operator=(const AsyncBlock&) = delete;
+
+    char* data = nullptr;
+    size_t size;
+    struct iocb request;
+    bool pending = false;
+    int64_t result = 0;  // of the last request, bytes or -errno
+};
+
+// Open file plus its AIO context and ring of `depth` blocks. Owned through a
+// unique_ptr by the reader and writer so that those stay movable while
+// requests are in flight.
+class AsyncFile {
+public:
+    AsyncFile(const std::string& filename, int flags, size_t depth,
+              size_t block_size)
+            : filename_(filename) {
+        fd_ = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+        if (fd_ == -1 && errno == EINVAL) {
+            direct_ = false;
+            fd_ = ::open(filename.c_str(), flags, 0644);
+        }
+        if (fd_ == -1) {
+            std::cerr << "Error opening file for direct I/O: " << filename << " - "
+                      << strerror(errno) << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        if (syscall(SYS_io_setup, depth, &context_) == -1) {
+            std::cerr << "Error setting up async I/O: " << filename << " - "
+                      << strerror(errno) << std::endl;
+            ::close(fd_);
+            throw std::runtime_error("Error setting up async I/O");
+        }
+        for (size_t i = 0; i < depth; ++i) {
+            blocks_.push_back(std::make_unique<AsyncBlock>(block_size));
+        }
+    }
+
+    ~AsyncFile() {
+        // The kernel may still be reading into or writing from the blocks.
+        for (auto& block : blocks_) {
+            while (block->pending && reap()) {
+            }
+        }
+        syscall(SYS_io_destroy, context_);
+        ::close(fd_);
+    }
+
+    AsyncFile(const AsyncFile&) = delete;
+    AsyncFile& operator=(const AsyncFile&) = delete;
+
+    int fd() const { return fd_; }
+
+    bool direct() const { return direct_; }
+
+    size_t depth() const { return blocks_.size(); }
+
+    AsyncBlock& block(size_t i) { return *blocks_[i]; }
+
+    void submit(AsyncBlock& block, off_t offset, size_t size, bool write) {
+        std::memset(&block.request, 0, sizeof(block.request));
+        block.request.aio_data = reinterpret_cast<uintptr_t>(&block);
+        block.request.aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        block.request.aio_fildes = static_cast<uint32_t>(fd_);
+        block.request.aio_buf = reinterpret_cast<uintptr_t>(block.data);
+        block.request.aio_nbytes = size;
+        block.request.aio_offset = offset;
+        struct iocb* list[1] = {&block.request};
+        if (syscall(SYS_io_submit, context_, 1, list) != 1) {
+            std::cerr << "Error submitting async I/O: " << filename_ << " - "
+                      << strerror(errno) << std::endl;
+            throw std::runtime_error("Error submitting async I/O");
+        }
+        block.pending = true;
+    }
+
+    // Waits for the block's request and returns the number of bytes moved.
+    size_t wait(AsyncBlock& block) {
+        if (!block.pending && block.result == 0) {
+            return 0;
+        }
+        while (block.pending) {
+            if (!reap()) {
+                throw std::runtime_error("Error waiting for async I/O");
+            }
+        }
+        int64_t result = block.result;
+        block.result = 0;
+        if (result < 0) {
+            std::cerr << "Error in async I/O: " << filename_ << " - "
+                      << strerror(static_cast<int>(-result)) << std::endl;
+            throw std::runtime_error("Error in async I/O");
+        }
+        if (!direct_) {
+            posix_fadvise(fd_, static_cast<off_t>(block.request.aio_offset), result,
+                          POSIX_FADV_DONTNEED);
+        }
+        return static_cast<size_t>(result);
+    }
+
+    void wait_all() {
+        for (auto& block : blocks_) {
+            wait(*block);
+        }
+    }
+
+private:
+    // Waits for at least one request and marks the finished ones done.
+    // False if io_getevents failed.
+    bool reap() {
+        struct io_event events[AIO_QUEUE_DEPTH];
+        long count;
+        do {
+            count = syscall(SYS_io_getevents, context_, 1, AIO_QUEUE_DEPTH, events,
+                            nullptr);
+        } while (count == -1 && errno == EINTR);
+        if (count == -1) {
+            std::cerr << "Error waiting for async I/O: " << filename_ << " - "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        for (long i = 0; i < count; ++i) {
+            AsyncBlock* done = reinterpret_cast<AsyncBlock*>(events[i].data);
+            done->result = events[i].res;
+            done->pending = false;
+        }
+        return true;
+    }
+
+    std::string filename_;
+    int fd_ = -1;
+    bool direct_ = true;
+    aio_context_t context_ = 0;
+    std::vector<std::unique_ptr<AsyncBlock>> blocks_;
+};
+
+// Opens `filename` with buffer_size bytes of blocks, as many as
+// direct_queue_depth allows.
+template <typename T>
+std::unique_ptr<AsyncFile> open_async_file(const std::string& filename,
+                                           int flags, size_t buffer_size) {
+    size_t depth = direct_queue_depth(sizeof(T), buffer_size);
+    return std::make_unique<AsyncFile>(
+            filename, flags, depth,
+            direct_block_size(sizeof(T), buffer_size / depth));
+}
+
+// Sequential reader over one sorted run that keeps the following blocks of
+// the file prefetching while the current one is consumed. buffer_size is
+// shared by all blocks in flight.
+template <typename T>
+class DirectRunReader {
+public:
+    DirectRunReader(const std::string& filename, size_t buffer_size)
+            : file_(open_async_file<T>(filename, O_RDONLY, buffer_size)) {
+        struct stat st;
+        if (fstat(file_->fd(), &st) == -1) {
+            throw std::runtime_error("Error reading file size");
+        }
+        file_size_ = static_cast<size_t>(st.st_size);
+        for (size_t i = 0; i < file_->depth(); ++i) {
+            prefetch(file_->block(i));
+        }
+        load();
+    }
+
+    bool exhausted() const { return pos_ == end_; }
+
+    const T& head() const { return data_[pos_]; }
+
+    void advance() {
+        if (++pos_ == end_) {
+            prefetch(file_->block(current_));
+            current_ = (current_ + 1) % file_->depth();
+            load();
+        }
+    }
+
+private:
+    void prefetch(AsyncBlock& block) {
+        if (next_offset_ < file_size_) {
+            file_->submit(block, next_offset_, block.size, false);
+            next_offset_ += block.size;
+        }
+    }
+
+    void load() {
+        AsyncBlock& block = file_->block(current_);
+        size_t bytes = file_->wait(block);
+        if (bytes % sizeof(T) != 0) {
+            throw std::runtime_error("Run file is not a whole number of elements");
+        }
+        data_ = reinterpret_cast<const T*>(block.data);
+        pos_ = 0;
+        end_ = bytes / sizeof(T);
+    }
+
+    std::unique_ptr<AsyncFile> file_;
+    size_t file_size_ = 0;
+    size_t next_offset_ = 0;
+    size_t current_ = 0;
+    const T* data_ = nullptr;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+};
+
+// Writer for one run: fills a block while earlier blocks are being written.
+// O_DIRECT needs aligned lengths, so the last block is padded and the file is
+// truncated back to its real size once everything has landed.
+template <typename T>
+class DirectRunWriter {
+public:
+    DirectRunWriter(const std::string& filename, size_t buffer_size)
+            : file_(open_async_file<T>(filename, O_WRONLY | O_CREAT | O_TRUNC,
+                                       buffer_size)) {}
+
+    // Like BufferedWriter, the last blocks are written on destruction, so a
+    // failed request can only be reported, not thrown.
+    ~DirectRunWriter() {
+        if (!file_) {
+            return;
+        }
+        try {
+            finish();
+        } catch (const std::exception& e) {
+            std::cerr << "Error finishing run file: " << e.what() << std::endl;
+        }
+    }
+
+    DirectRunWriter(DirectRunWriter&&) = default;
+
+    void put(const T& value) { write(&value, 1); }
+
+    void write(const T* data, size_t count) {
+        const char* bytes = reinterpret_cast<const char*>(data);
+        size_t size = count * sizeof(T);
+        while (size > 0) {
+            AsyncBlock& block = file_->block(current_);
+            size_t n = std::min(size, block.size - fill_);
+            std::memcpy(block.data + fill_, bytes, n);
+            fill_ += n;
+            bytes += n;
+            size -= n;
+            if (fill_ == block.size) {
+                submit_current(block.size);
+            }
+        }
+    }
+
+private:
+    void submit_current(size_t size) {
+        AsyncBlock& block = file_->block(current_);
+        file_->submit(block, offset_, size, true);
+        offset_ += size;
+        logical_size_ += fill_;
+        fill_ = 0;
+        current_ = (current_ + 1) % file_->depth();
+        file_->wait(file_->block(current_));
+    }
+
+    void finish() {
+        if (fill_ > 0) {
+            size_t size = fill_;
+            if (file_->direct()) {
+                size = (fill_ + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT *
+                       DIRECT_IO_ALIGNMENT;
+                std::memset(file_->block(current_).data + fill_, 0, size - fill_);
+            }
+            submit_current(size);
+        }
+        file_->wait_all();
+        if (offset_ != logical_size_ &&
+            ftruncate(file_->fd(), static_cast<off_t>(logical_size_)) == -1) {
+            std::cerr << "Error truncating run file: " << strerror(errno)
+                      << std::endl;
+        }
+    }
+
+    std::unique_ptr<AsyncFile> file_;
+    size_t current_ = 0;
+    size_t fill_ = 0;
+    size_t offset_ = 0;
+    size_t logical_size_ = 0;
+};
+
+template <typename T>
+struct DirectIo {
+    using Reader = DirectRunReader<T>;
+    using Writer = DirectRunWriter<T>;
+    using OutputWriter = DirectRunWriter<T>;
+    static const bool plain_runs = true;
+};
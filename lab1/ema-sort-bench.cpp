@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "external_sort.h"
+#include "input_gen.h"
+
+// Throughput benchmark for the ema-sort-int engine. Sweeps file size x chunk
+// size x thread count, runs every configuration for a number of iterations
+// and reports the percentiles of each phase and of the sort throughput, as a
+// table and optionally as JSON for comparing builds.
+
+const char* const PHASE_NAMES[] = {"generate", "read",  "sort", "spill",
+                                   "merge",    "write", "total"};
+
+struct Percentiles {
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double mean = 0;
+};
+
+// Nearest-rank percentiles of the samples.
+Percentiles percentiles(std::vector<double> samples) {
+    Percentiles result;
+    if (samples.empty()) {
+        return result;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto rank = [&samples](double p) {
+        size_t index = static_cast<size_t>(std::ceil(p * samples.size()));
+        return samples[std::max<size_t>(1, index) - 1];
+    };
+    result.p50 = rank(0.50);
+    result.p90 = rank(0.90);
+    result.p99 = rank(0.99);
+    for (double sample : samples) {
+        result.mean += sample;
+    }
+    result.mean /= samples.size();
+    return result;
+}
+
+struct BenchConfig {
+    size_t file_size_mb;
+    size_t chunk_size_mb;
+    unsigned threads;
+};
+
+struct BenchResult {
+    BenchConfig config;
+    SortStats last_stats;
+    std::map<std::string, std::vector<double>> phase_seconds;
+    std::vector<double> throughput_mb_s;
+};
+
+// Parses "1,4,16" into numbers.
+bool parse_list(const std::string& text, std::vector<size_t>& values) {
+    values.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        try {
+            values.push_back(std::stoul(item));
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return !values.empty();
+}
+
+bool parse_flag(const std::string& arg, const std::string& name,
+                std::string& value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+void print_usage() {
+    std::cerr << "Usage: ema-sort-bench [--sizes=MB,...] [--chunks=MB,...]"
+                 " [--threads=N,...] [--iterations=N]"
+                 " [--type=char|int32|int64|uint64|record16|record100]"
+                 " [--dist=uniform|sorted|reverse|few-unique|zipf] [--seed=N]"
+                 " [--mem-limit=MB] [--run-gen=sort|replacement]"
+                 " [--run-sort=auto|comparison]"
+                 " [--io=buffered|direct] [--codec=none|delta]"
+                 " [--label=NAME] [--json=FILE|-]"
+              << std::endl;
+}
+
+void write_percentiles(std::ostream& out, const Percentiles& p) {
+    out << "{\"p50\": " << p.p50 << ", \"p90\": " << p.p90 << ", \"p99\": " << p.p99
+        << ", \"mean\": " << p.mean << "}";
+}
+
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> sizes = {16, 64};
+    std::vector<size_t> chunks = {1, 4};
+    std::vector<size_t> thread_counts = {
+            1, std::max(1u, std::thread::hardware_concurrency())};
+    size_t iterations = 3;
+    std::string type = "int32";
+    std::string dist = "uniform";
+    std::string run_gen = "sort";
+    std::string run_sort = "auto";
+    std::string io = "buffered";
+    std::string codec = "none";
+    std::string label;
+    std::string json_filename;
+    size_t mem_limit_mb = 0;
+    Distribution distribution = Distribution::Uniform;
+    uint64_t seed = (static_cast<uint64_t>(std::random_device{}()) << 32) |
+                    std::random_device{}();
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        std::string value;
+        bool ok = true;
+        if (parse_flag(arg, "sizes", value)) {
+            ok = parse_list(value, sizes);
+        } else if (parse_flag(arg, "chunks", value)) {
+            ok = parse_list(value, chunks);
+        } else if (parse_flag(arg, "threads", value)) {
+            ok = parse_list(value, thread_counts);
+        } else if (parse_flag(arg, "iterations", value)) {
+            iterations = std::max<size_t>(1, std::stoul(value));
+        } else if (parse_flag(arg, "type", value)) {
+            type = value;
+        } else if (parse_flag(arg, "dist", value)) {
+            dist = value;
+        } else if (parse_flag(arg, "seed", value)) {
+            seed = std::stoull(value);
+        } else if (parse_flag(arg, "mem-limit", value)) {
+            mem_limit_mb = std::stoul(value);
+        } else if (parse_flag(arg, "run-gen", value)) {
+            run_gen = value;
+        } else if (parse_flag(arg, "run-sort", value)) {
+            run_sort = value;
+        } else if (parse_flag(arg, "io", value)) {
+            io = value;
+        } else if (parse_flag(arg, "codec", value)) {
+            codec = value;
+        } else if (parse_flag(arg, "label", value)) {
+            label = value;
+        } else if (parse_flag(arg, "json", value)) {
+            json_filename = value;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            print_usage();
+            return 1;
+        }
+    }
+    if (element_size(type) == 0 || !parse_distribution(dist, distribution) ||
+        (run_gen != "sort" && run_gen != "replacement") ||
+        (run_sort != "auto" && run_sort != "comparison") ||
+        (io != "buffered" && io != "direct") ||
+        (codec != "none" && codec != "delta") ||
+        (codec != "none" && io == "direct")) {
+        print_usage();
+        return 1;
+    }
+
+    std::string input_filename = "bench_input.bin";
+    std::string output_filename = "bench_output.bin";
+    std::vector<BenchResult> results;
+
+    // With --json=- stdout carries the JSON document, so the table moves to
+    // stderr.
+    std::ostream& table = json_filename == "-" ? std::cerr : std::cout;
+    table << std::fixed << std::setprecision(3);
+    for (size_t size_mb : sizes) {
+        for (size_t chunk_mb : chunks) {
+            for (size_t threads : thread_counts) {
+                BenchResult result;
+                result.config = {size_mb, chunk_mb,
+                                 static_cast<unsigned>(std::max<size_t>(1, threads))};
+                SortOptions options;
+                options.chunk_size = chunk_mb * 1024 * 1024;
+                options.threads = result.config.threads;
+                options.mem_limit = mem_limit_mb * 1024 * 1024;
+                options.run_generation = run_gen == "replacement"
+                                                 ? RunGeneration::ReplacementSelection
+                                                 : RunGeneration::ChunkSort;
+                options.run_sort = run_sort == "comparison" ? RunSort::Comparison
+                                                            : RunSort::Auto;
+                options.io = io == "direct" ? IoBackend::Direct : IoBackend::Buffered;
+                options.codec = codec == "delta" ? RunCodec::Delta : RunCodec::None;
+                size_t file_size = size_mb * 1024 * 1024;
+                file_size -= file_size % element_size(type);
+
+                for (size_t i = 0; i < iterations; ++i) {
+                    auto generate_start = std::chrono::steady_clock::now();
+                    with_element_type(type, [&](auto element) {
+                        using T = typename decltype(element)::type;
+                        generate_input_file<T>(input_filename, file_size, distribution,
+                                               seed + i, options.threads);
+                    });
+                    double generate_seconds = seconds_since(generate_start);
+
+                    auto sort_start = std::chrono::steady_clock::now();
+                    SortStats stats = with_element_type(type, [&](auto element) {
+                        using Element = decltype(element);
+                        return chunked_sort_file<typename Element::type,
+                                                 typename Element::key_of>(
+                                input_filename, output_filename, options);
+                    });
+                    double total_seconds = seconds_since(sort_start);
+
+                    auto& phases = result.phase_seconds;
+                    phases["generate"].push_back(generate_seconds);
+                    phases["read"].push_back(stats.phases.read_seconds);
+                    phases["sort"].push_back(stats.phases.sort_seconds);
+                    phases["spill"].push_back(stats.phases.spill_seconds);
+                    phases["merge"].push_back(stats.phases.merge_seconds);
+                    phases["write"].push_back(stats.phases.write_seconds);
+                    phases["total"].push_back(total_seconds);
+                    result.throughput_mb_s.push_back(
+                            file_size / (1024.0 * 1024.0) /
+                            std::max(total_seconds, 1e-9));
+                    result.last_stats = stats;
+                    remove(input_filename.c_str());
+                    remove(output_filename.c_str());
+                }
+
+                Percentiles throughput = percentiles(result.throughput_mb_s);
+                table << "size " << size_mb << " MB, chunk " << chunk_mb
+                      << " MB, threads " << result.config.threads << ": "
+                      << throughput.p50 << " MB/s p50, " << throughput.p90
+                      << " MB/s p90, runs " << result.last_stats.runs
+                      << ", merge passes " << result.last_stats.merge_passes
+                      << std::endl;
+                for (const char* name : PHASE_NAMES) {
+                    Percentiles p = percentiles(result.phase_seconds[name]);
+                    table << "  " << std::setw(8) << name << ": p50 " << p.p50
+                          << " s, p90 " << p.p90 << " s, p99 " << p.p99
+                          << " s" << std::endl;
+                }
+                results.push_back(std::move(result));
+            }
+        }
+    }
+
+    if (json_filename.empty()) {
+        return 0;
+    }
+    std::ofstream json_file;
+    if (json_filename != "-") {
+        json_file.open(json_filename);
+        if (!json_file.is_open()) {
+            std::cerr << "Error opening file for writing: " << json_filename
+                      << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& json = json_filename == "-" ? std::cout : json_file;
+    json << std::setprecision(6);
+    json << "{\n  \"label\": " << json_string(label)
+         << ",\n  \"compiler\": " << json_string(__VERSION__)
+         << ",\n  \"type\": " << json_string(type)
+         << ",\n  \"dist\": " << json_string(dist) << ",\n  \"seed\": " << seed
+         << ",\n  \"iterations\": " << iterations
+         << ",\n  \"run_gen\": " << json_string(run_gen)
+         << ",\n  \"run_sort\": " << json_string(run_sort)
+         << ",\n  \"io\": " << json_string(io)
+         << ",\n  \"codec\": " << json_string(codec)
+         << ",\n  \"mem_limit_mb\": " << mem_limit_mb << ",\n  \"results\": [";
+    for (size_t r = 0; r < results.size(); ++r) {
+        const BenchResult& result = results[r];
+        json << (r == 0 ? "\n" : ",\n") << "    {\"file_size_mb\": "
+             << result.config.file_size_mb
+             << ", \"chunk_size_mb\": " << result.config.chunk_size_mb
+             << ", \"threads\": " << result.config.threads
+             << ", \"runs\": " << result.last_stats.runs
+             << ", \"merge_passes\": " << result.last_stats.merge_passes
+             << ",\n     \"throughput_mb_s\": ";
+        write_percentiles(json, percentiles(result.throughput_mb_s));
+        json << ",\n     \"phase_seconds\": {";
+        for (size_t p = 0; p < std::size(PHASE_NAMES); ++p) {
+            json << (p == 0 ? "\n" : ",\n") << "       "
+                 << json_string(PHASE_NAMES[p]) << ": ";
+            write_percentiles(json, percentiles(result.phase_seconds.at(PHASE_NAMES[p])));
+        }
+        json << "}}";
+    }
+    json << "\n  ]\n}" << std::endl;
+    return 0;
+}
@@ -1,133 +1,167 @@
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <cerrno>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
-namespace fs = std::filesystem;
 
-void create_random_binary_file(const std::string& filename, size_t size) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Error opening file for writing: " << filename << std::endl;
-        throw std::runtime_error("Error opening file");
-    }
+#include "external_sort.h"
+#include "input_gen.h"
+namespace fs = std::filesystem;
 
-    std::vector<char> data(size);
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> distrib(0, 255);
+using ByteHistogram = std::array<uint64_t, 256>;
 
+void count_bytes(const char* data, size_t size, ByteHistogram& histogram) {
     for (size_t i = 0; i < size; ++i) {
-        data[i] = static_cast<char>(distrib(gen));
-    }
-
-    file.write(data.data(), data.size());
-    file.close();
-}
-
-std::vector<char> read_binary_file(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        std::cerr << "Error opening file for reading: " << filename << std::endl;
-        throw std::runtime_error("Error opening file");
+        ++histogram[static_cast<unsigned char>(data[i])];
     }
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    std::vector<char> buffer(size);
-    if (size > 0) {
-        if (!file.read(buffer.data(), size)) {
-            std::cerr << "Error reading from file: " << filename << std::endl;
-            throw std::runtime_error("Error reading from file");
-        }
-    }
-
-    return buffer;
 }
 
-void write_binary_file(const std::string& filename,
-                       const std::vector<char>& data) {
-    std::ofstream file(filename, std::ios::binary);
-    if (!file.is_open()) {
-        std::cerr << "Error opening file for writing: " << filename << std::endl;
+// Counting sort for byte data: there are only 256 distinct keys, so one
+// streaming pass builds the histogram and one pass writes the sorted output.
+// No temp chunk files and no merge are needed. Each chunk is split between
+// `threads` workers, every worker counting into its own histogram.
+void histogram_sort_file(const std::string& input_filename,
+                         const std::string& output_filename, size_t chunk_size,
+                         unsigned threads) {
+    std::ifstream input(input_filename, std::ios::binary);
+    if (!input.is_open()) {
+        std::cerr << "Error opening file for reading: " << input_filename
+                  << std::endl;
         throw std::runtime_error("Error opening file");
     }
 
-    file.write(data.data(), data.size());
-    file.close();
-}
-
-void merge_sorted_chunks(const std::vector<std::string>& chunk_filenames,
-                         const std::string& output_filename) {
-    std::vector<std::ifstream> chunk_files(chunk_filenames.size());
-    std::vector<char> current_elements(chunk_filenames.size());
-    std::vector<bool> eof_flags(chunk_filenames.size(), false);
-
-    for (size_t i = 0; i < chunk_filenames.size(); ++i) {
-        chunk_files[i].open(chunk_filenames[i], std::ios::binary);
-        if (!chunk_files[i].is_open()) {
-            std::cerr << "Error opening chunk file for reading: "
-                      << chunk_filenames[i] << std::endl;
-            throw std::runtime_error("Error opening file");
+    ByteHistogram total{};
+    std::vector<ByteHistogram> partial(threads);
+    std::vector<char> chunk(chunk_size);
+    while (input.read(chunk.data(), chunk.size()) || input.gcount() > 0) {
+        size_t size = static_cast<size_t>(input.gcount());
+        if (threads <= 1) {
+            count_bytes(chunk.data(), size, total);
+            continue;
         }
 
-        if (chunk_files[i].read(&current_elements[i], 1)) {
-        } else {
-            eof_flags[i] = true;
+        size_t slice = (size + threads - 1) / threads;
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            size_t begin = std::min(size, t * slice);
+            size_t end = std::min(size, begin + slice);
+            partial[t].fill(0);
+            workers.emplace_back(count_bytes, chunk.data() + begin, end - begin,
+                                 std::ref(partial[t]));
+        }
+        for (unsigned t = 0; t < threads; ++t) {
+            workers[t].join();
+            for (size_t b = 0; b < total.size(); ++b) {
+                total[b] += partial[t][b];
+            }
         }
     }
 
-    std::ofstream output_file(output_filename, std::ios::binary);
-    if (!output_file.is_open()) {
-        std::cerr << "Error opening output file for writing: " << output_filename
-                  << std::endl;
-        throw std::runtime_error("Error opening file");
+    BufferedWriter<char> output(output_filename, MERGE_WRITE_BUFFER_SIZE);
+    for (int value = std::numeric_limits<char>::min();
+         value <= std::numeric_limits<char>::max(); ++value) {
+        char c = static_cast<char>(value);
+        output.fill(c, total[static_cast<unsigned char>(c)]);
     }
+}
 
-    while (true) {
-        int min_index = -1;
-        char min_element = 0;
+void print_usage() {
+    std::cerr << "Usage: ema-sort-int <iterations> <file_size_mb> <chunk_size_mb>"
+                 " [--mode=chunked|histogram] [--threads=N]"
+                 " [--type=char|int32|int64|uint64|record16|record100]"
+                 " [--mem-limit=MB] [--fan-in=N] [--run-gen=sort|replacement]"
+                 " [--run-sort=auto|comparison]"
+                 " [--io=buffered|direct] [--codec=none|delta]"
+                 " [--dist=uniform|sorted|reverse|few-unique|zipf] [--seed=N]"
+              << std::endl;
+}
 
-        for (size_t i = 0; i < chunk_filenames.size(); ++i) {
-            if (!eof_flags[i]) {
-                if (min_index == -1 || current_elements[i] < min_element) {
-                    min_index = i;
-                    min_element = current_elements[i];
-                }
-            }
-        }
+// Matches "--name=value" and stores the value part.
+bool parse_flag(const std::string& arg, const std::string& name,
+                std::string& value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
 
-        if (min_index == -1) {
-            break;
-        }
-        output_file.write(&min_element, 1);
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        print_usage();
+        return 1;
+    }
 
-        if (chunk_files[min_index].read(&current_elements[min_index], 1)) {
+    Distribution distribution = Distribution::Uniform;
+    std::string mode = "chunked";
+    std::string type = "char";
+    unsigned threads = 1;
+    size_t mem_limit_mb = 0;
+    size_t fan_in = 0;
+    std::string run_gen = "sort";
+    std::string run_sort = "auto";
+    std::string io = "buffered";
+    std::string codec = "none";
+    std::string dist = "uniform";
+    uint64_t seed = (static_cast<uint64_t>(std::random_device{}()) << 32) |
+                    std::random_device{}();
+    for (int a = 4; a < argc; ++a) {
+        std::string arg = argv[a];
+        std::string value;
+        if (parse_flag(arg, "mode", value)) {
+            mode = value;
+        } else if (parse_flag(arg, "type", value)) {
+            type = value;
+        } else if (parse_flag(arg, "threads", value)) {
+            threads = static_cast<unsigned>(std::max(1, std::stoi(value)));
+        } else if (parse_flag(arg, "mem-limit", value)) {
+            mem_limit_mb = std::stoul(value);
+        } else if (parse_flag(arg, "fan-in", value)) {
+            fan_in = std::stoul(value);
+        } else if (parse_flag(arg, "run-gen", value)) {
+            run_gen = value;
+        } else if (parse_flag(arg, "run-sort", value)) {
+            run_sort = value;
+        } else if (parse_flag(arg, "io", value)) {
+            io = value;
+        } else if (parse_flag(arg, "codec", value)) {
+            codec = value;
+        } else if (parse_flag(arg, "dist", value)) {
+            dist = value;
+        } else if (parse_flag(arg, "seed", value)) {
+            seed = std::stoull(value);
         } else {
-            eof_flags[min_index] = true;
+            print_usage();
+            return 1;
         }
     }
-
-    for (auto& file : chunk_files) {
-        file.close();
-    }
-
-    output_file.close();
-}
-
-int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cerr
-                << "Usage: ema-sort-int <iterations> <file_size_mb> <chunk_size_mb>"
-                << std::endl;
+    // Counting sort only applies to byte keys, and encoded runs go through
+    // the page cache.
+    if ((mode != "chunked" && mode != "histogram") || element_size(type) == 0 ||
+        (mode == "histogram" && type != "char") ||
+        (run_gen != "sort" && run_gen != "replacement") ||
+        (run_sort != "auto" && run_sort != "comparison") ||
+        (io != "buffered" && io != "direct") ||
+        (codec != "none" && codec != "delta") ||
+        (codec != "none" && io == "direct") ||
+        !parse_distribution(dist, distribution)) {
+        print_usage();
         return 1;
     }
 
@@ -136,8 +170,21 @@ int main(int argc, char* argv[]) {
     int chunk_size_mb = std::stoi(argv[3]);
 
     size_t file_size = static_cast<size_t>(file_size_mb) * 1024 * 1024;
+    file_size -= file_size % element_size(type);
     size_t chunk_size = static_cast<size_t>(chunk_size_mb) * 1024 * 1024;
 
+    SortOptions options;
+    options.chunk_size = chunk_size;
+    options.threads = threads;
+    options.mem_limit = mem_limit_mb * 1024 * 1024;
+    options.fan_in = fan_in;
+    options.run_generation = run_gen == "replacement"
+                                     ? RunGeneration::ReplacementSelection
+                                     : RunGeneration::ChunkSort;
+    options.run_sort = run_sort == "comparison" ? RunSort::Comparison : RunSort::Auto;
+    options.io = io == "direct" ? IoBackend::Direct : IoBackend::Buffered;
+    options.codec = codec == "delta" ? RunCodec::Delta : RunCodec::None;
+
     std::string input_filename = "input.bin";
     std::string output_filename = "test_output.bin";
 
@@ -147,38 +194,30 @@ int main(int argc, char* argv[]) {
 
     std::cout << "Starting ema-sort-int with " << iterations
               << " iterations, file size: " << file_size_mb
-              << " MB, chunk size: " << chunk_size_mb << " MB" << std::endl;
+              << " MB, chunk size: " << chunk_size_mb << " MB, mode: " << mode
+              << ", type: " << type << ", dist: " << dist << ", seed: " << seed
+              << std::endl;
 
     for (int i = 0; i < iterations; ++i) {
-        auto start_time = std::chrono::high_resolution_clock::now();
-
-        create_random_binary_file(input_filename, file_size);
-        std::vector<char> data = read_binary_file(input_filename);
-
-        if (data.size() <= chunk_size) {
-            std::sort(data.begin(), data.end());
-            write_binary_file(output_filename, data);
+        // Input generation stays outside the timed region.
+        with_element_type(type, [&](auto element) {
+            using T = typename decltype(element)::type;
+            generate_input_file<T>(input_filename, file_size, distribution,
+                                   seed + i, threads);
+        });
 
+        auto start_time = std::chrono::high_resolution_clock::now();
+        SortStats stats;
+        if (mode == "histogram") {
+            histogram_sort_file(input_filename, output_filename,
+                                run_chunk_size(options), threads);
         } else {
-            std::vector<std::string> chunk_filenames;
-            for (size_t j = 0; j < data.size(); j += chunk_size) {
-                size_t current_chunk_size = std::min(chunk_size, data.size() - j);
-                std::vector<char> chunk(data.begin() + j,
-                                        data.begin() + j + current_chunk_size);
-                std::sort(chunk.begin(), chunk.end());
-
-                std::string chunk_filename = "temp_chunk_" + std::to_string(j) + ".bin";
-                write_binary_file(chunk_filename, chunk);
-                chunk_filenames.push_back(chunk_filename);
-            }
-            merge_sorted_chunks(chunk_filenames, "merged_output.bin");
-            std::vector<char> merged_data = read_binary_file("merged_output.bin");
-            write_binary_file(output_filename, merged_data);
-
-            for (const auto& filename : chunk_filenames) {
-                remove(filename.c_str());
-            }
-            remove("merged_output.bin");
+            stats = with_element_type(type, [&](auto element) {
+                using Element = decltype(element);
+                return chunked_sort_file<typename Element::type,
+                                         typename Element::key_of>(
+                        input_filename, output_filename, options);
+            });
         }
         auto end_time = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
@@ -187,6 +226,34 @@ int main(int argc, char* argv[]) {
         std::cout << "Iteration " << i + 1 << ": Sorted " << file_size_mb
                   << " MB in " << std::fixed << std::setprecision(3) << seconds
                   << " seconds" << std::endl;
+        if (stats.runs > 0) {
+            std::cout << "Runs: " << stats.runs
+                      << ", merge passes: " << stats.merge_passes;
+            if (stats.merge_passes > 0) {
+                std::cout << ", fan-in: " << stats.fan_in;
+            }
+            std::cout << std::endl;
+        }
+        if (mode == "chunked") {
+            const SortPhases& phases = stats.phases;
+            std::cout << "Phases: read " << phases.read_seconds << " s, sort "
+                      << phases.sort_seconds << " s, spill "
+                      << phases.spill_seconds << " s, merge "
+                      << phases.merge_seconds << " s, write "
+                      << phases.write_seconds << " s" << std::endl;
+        }
+        if (stats.spilled_runs > 0) {
+            double runs = static_cast<double>(stats.spilled_runs);
+            std::cout << "Spill codec: " << stats.spilled_runs << " runs, "
+                      << stats.spill_raw_bytes / (1024.0 * 1024.0) << " MB -> "
+                      << stats.spill_encoded_bytes / (1024.0 * 1024.0)
+                      << " MB, ratio "
+                      << static_cast<double>(stats.spill_raw_bytes) /
+                                 std::max<uint64_t>(1, stats.spill_encoded_bytes)
+                      << ", encode " << stats.encode_seconds * 1000 / runs
+                      << " ms/run, decode " << stats.decode_seconds * 1000 / runs
+                      << " ms/run" << std::endl;
+        }
 
         remove(input_filename.c_str());
 
@@ -195,6 +262,9 @@ int main(int argc, char* argv[]) {
             outfile.close();
         }
     }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Peak RSS: " << usage.ru_maxrss / 1024 << " MB" << std::endl;
     std::cout << "Exit status: 0" << std::endl;
 
     return 0;
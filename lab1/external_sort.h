@@ -0,0 +1,899 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "direct_io.h"
+#include "radix_sort.h"
+#include "run_codec.h"
+#include "thread_pool.h"
+
+// External sort engine used by ema-sort-int. Everything is templated on the
+// element type T and on a key extractor KeyOf, so the comparisons in the run
+// sort and in the merge are inlined for the type picked at compile time.
+
+const size_t MERGE_READ_BUFFER_SIZE = 1024 * 1024;
+const size_t MERGE_WRITE_BUFFER_SIZE = 4 * 1024 * 1024;
+const size_t MIN_MERGE_READ_BUFFER_SIZE = 64 * 1024;
+const size_t SPILL_BUFFER_SIZE = 1024 * 1024;
+// File descriptors kept free for the output, stdio and the rest of the process
+// when the fan-in is derived from RLIMIT_NOFILE.
+const size_t MERGE_RESERVED_FDS = 16;
+
+enum class IoBackend {
+    Buffered,  // std::fstream through the page cache
+    Direct,    // O_DIRECT with asynchronous requests, see direct_io.h
+};
+
+enum class RunCodec {
+    None,   // runs hold raw elements
+    Delta,  // runs are encoded, see run_codec.h
+};
+
+enum class RunSort {
+    Auto,        // radix sort when the key is integral, else comparison sort
+    Comparison,  // always parallel_sort
+};
+
+enum class RunGeneration {
+    ChunkSort,             // sort chunk-sized pieces of the input
+    ReplacementSelection,  // stream the input through a heap
+};
+
+// Tuning knobs of the external sort, filled from the command line.
+struct SortOptions {
+    size_t chunk_size = 0;  // bytes sorted in memory per run
+    unsigned threads = 1;
+    size_t mem_limit = 0;   // bytes of sort buffers, 0 for no limit
+    size_t fan_in = 0;      // most runs merged at once, 0 to derive it
+    RunGeneration run_generation = RunGeneration::ChunkSort;
+    RunSort run_sort = RunSort::Auto;
+    IoBackend io = IoBackend::Buffered;
+    RunCodec codec = RunCodec::None;
+};
+
+// Seconds spent in each phase of a sort. A phase run by several threads at
+// once is summed over them, so with the run generation pipeline the phases
+// can add up to more than the wall time. Replacement selection interleaves
+// reading, heap work and spilling, and counts all of it as sort time.
+struct SortPhases {
+    double read_seconds = 0;
+    double sort_seconds = 0;
+    double spill_seconds = 0;
+    double merge_seconds = 0;  // intermediate merge passes
+    double write_seconds = 0;  // final merge pass, or the single sorted chunk
+
+    SortPhases& operator+=(const SortPhases& other) {
+        read_seconds += other.read_seconds;
+        sort_seconds += other.sort_seconds;
+        spill_seconds += other.spill_seconds;
+        merge_seconds += other.merge_seconds;
+        write_seconds += other.write_seconds;
+        return *this;
+    }
+};
+
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+            .count();
+}
+
+// What a sort did, for reporting.
+struct SortStats {
+    size_t runs = 0;
+    size_t merge_passes = 0;
+    size_t fan_in = 0;
+    // Spill codec traffic, all zero unless runs are encoded.
+    size_t spilled_runs = 0;
+    uint64_t spill_raw_bytes = 0;
+    uint64_t spill_encoded_bytes = 0;
+    double encode_seconds = 0;
+    double decode_seconds = 0;
+    SortPhases phases;
+};
+
+// Buffer of the writer each worker spills its runs through. Under a memory
+// budget it takes at most a quarter of the worker's share.
+inline size_t spill_buffer_size(const SortOptions& options) {
+    if (options.mem_limit == 0) {
+        return SPILL_BUFFER_SIZE;
+    }
+    size_t per_worker = options.mem_limit / std::max(1u, options.threads);
+    return std::min(SPILL_BUFFER_SIZE, per_worker / 4);
+}
+
+// Bytes of input held in memory per run. Under a memory budget run
+// generation holds one chunk per worker plus the one being read and the one
+// being spilled (see generate_runs), next to the spill buffer. A chunk being
+// sorted may need a buffer of its size again: the merges of parallel_sort
+// with more than one thread, or the radix sort's scratch buffer when `radix`
+// is set.
+inline size_t run_chunk_size(const SortOptions& options, bool radix = false) {
+    if (options.mem_limit == 0) {
+        return options.chunk_size;
+    }
+    size_t threads = std::max(1u, options.threads);
+    size_t chunks = threads * (threads > 1 || radix ? 2 : 1) + 2;
+    return std::min(options.chunk_size,
+                    (options.mem_limit - spill_buffer_size(options)) / chunks);
+}
+
+// Memory the merge may use for its buffers: the --mem-limit budget or, without
+// one, what run generation already held (one chunk per worker).
+inline size_t merge_memory_budget(const SortOptions& options) {
+    if (options.mem_limit != 0) {
+        return options.mem_limit;
+    }
+    return options.chunk_size * std::max(1u, options.threads);
+}
+
+inline size_t merge_write_buffer_size(const SortOptions& options) {
+    return std::min(MERGE_WRITE_BUFFER_SIZE, merge_memory_budget(options) / 4);
+}
+
+// Per-run read buffer of a merge over `runs` runs: the runs share what the
+// output buffer leaves of the budget.
+inline size_t merge_read_buffer_size(const SortOptions& options, size_t runs) {
+    size_t share = (merge_memory_budget(options) -
+                    merge_write_buffer_size(options)) /
+                   std::max<size_t>(1, runs);
+    return std::max(MIN_MERGE_READ_BUFFER_SIZE,
+                    std::min(MERGE_READ_BUFFER_SIZE, share));
+}
+
+template <typename T>
+struct IdentityKey {
+    const T& operator()(const T& value) const { return value; }
+};
+
+template <typename T, typename KeyOf>
+struct KeyLess {
+    bool operator()(const T& a, const T& b) const {
+        return KeyOf()(a) < KeyOf()(b);
+    }
+};
+
+// Fixed-width record sorted by a key stored in its leading bytes.
+template <size_t Width>
+struct FixedRecord {
+    unsigned char bytes[Width];
+};
+
+// 16-byte record keyed by the native-endian uint64_t in its first 8 bytes.
+using Record16 = FixedRecord<16>;
+
+struct Record16Key {
+    uint64_t operator()(const Record16& record) const {
+        uint64_t key;
+        std::memcpy(&key, record.bytes, sizeof(key));
+        return key;
+    }
+};
+
+// 100-byte record with a 10-byte key compared bytewise, as in the classic
+// sort benchmark format.
+using Record100 = FixedRecord<100>;
+
+struct Record100Key {
+    std::array<unsigned char, 10> operator()(const Record100& record) const {
+        std::array<unsigned char, 10> key;
+        std::memcpy(key.data(), record.bytes, key.size());
+        return key;
+    }
+};
+
+template <typename T, typename KeyOf = IdentityKey<T>>
+struct ElementType {
+    using type = T;
+    using key_of = KeyOf;
+};
+
+// Size in bytes of one element of the given --type, or 0 if unknown.
+inline size_t element_size(const std::string& type) {
+    if (type == "char") return sizeof(char);
+    if (type == "int32") return sizeof(int32_t);
+    if (type == "int64") return sizeof(int64_t);
+    if (type == "uint64") return sizeof(uint64_t);
+    if (type == "record16") return sizeof(Record16);
+    if (type == "record100") return sizeof(Record100);
+    return 0;
+}
+
+// Calls f(ElementType<...>()) for the element type picked on the command
+// line, so every branch is instantiated with its own inlined comparator.
+template <typename F>
+auto with_element_type(const std::string& type, F&& f) {
+    if (type == "char") {
+        return f(ElementType<char>());
+    } else if (type == "int32") {
+        return f(ElementType<int32_t>());
+    } else if (type == "int64") {
+        return f(ElementType<int64_t>());
+    } else if (type == "uint64") {
+        return f(ElementType<uint64_t>());
+    } else if (type == "record16") {
+        return f(ElementType<Record16, Record16Key>());
+    } else {
+        return f(ElementType<Record100, Record100Key>());
+    }
+}
+
+template <typename T>
+std::vector<T> read_binary_file(const std::string& filename) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "elements are read as raw bytes");
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for reading: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    std::vector<T> buffer(static_cast<size_t>(size) / sizeof(T));
+    if (!buffer.empty()) {
+        if (!file.read(reinterpret_cast<char*>(buffer.data()),
+                       buffer.size() * sizeof(T))) {
+            std::cerr << "Error reading from file: " << filename << std::endl;
+            throw std::runtime_error("Error reading from file");
+        }
+    }
+
+    return buffer;
+}
+
+template <typename T>
+void write_binary_file(const std::string& filename, const std::vector<T>& data) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+
+    file.write(reinterpret_cast<const char*>(data.data()),
+               data.size() * sizeof(T));
+    file.close();
+}
+
+// Sequential reader over one sorted run. Refills a large buffer instead of
+// issuing one stream call per element.
+template <typename T>
+class RunReader {
+public:
+    RunReader(const std::string& filename, size_t buffer_size)
+            : file_(filename, std::ios::binary),
+              buffer_(std::max<size_t>(1, buffer_size / sizeof(T))) {
+        if (!file_.is_open()) {
+            std::cerr << "Error opening chunk file for reading: " << filename
+                      << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        refill();
+    }
+
+    bool exhausted() const { return pos_ == end_; }
+
+    const T& head() const { return buffer_[pos_]; }
+
+    void advance() {
+        if (++pos_ == end_) {
+            refill();
+        }
+    }
+
+private:
+    void refill() {
+        file_.read(reinterpret_cast<char*>(buffer_.data()),
+                   buffer_.size() * sizeof(T));
+        pos_ = 0;
+        end_ = static_cast<size_t>(file_.gcount()) / sizeof(T);
+    }
+
+    std::ifstream file_;
+    std::vector<T> buffer_;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+};
+
+// Accumulates output and hands it to the stream in large blocks.
+template <typename T>
+class BufferedWriter {
+public:
+    BufferedWriter(const std::string& filename, size_t buffer_size)
+            : file_(filename, std::ios::binary) {
+        if (!file_.is_open()) {
+            std::cerr << "Error opening output file for writing: " << filename
+                      << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        buffer_.reserve(std::max<size_t>(1, buffer_size / sizeof(T)));
+    }
+
+    ~BufferedWriter() { flush(); }
+
+    void put(const T& value) {
+        buffer_.push_back(value);
+        if (buffer_.size() == buffer_.capacity()) {
+            flush();
+        }
+    }
+
+    void write(const T* data, size_t count) {
+        if (count >= buffer_.capacity()) {
+            flush();
+            file_.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+            return;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            put(data[i]);
+        }
+    }
+
+    void fill(const T& value, size_t count) {
+        while (count > 0) {
+            size_t n = std::min(count, buffer_.capacity() - buffer_.size());
+            buffer_.insert(buffer_.end(), n, value);
+            count -= n;
+            if (buffer_.size() == buffer_.capacity()) {
+                flush();
+            }
+        }
+    }
+
+    void flush() {
+        if (!buffer_.empty()) {
+            file_.write(reinterpret_cast<const char*>(buffer_.data()),
+                        buffer_.size() * sizeof(T));
+            buffer_.clear();
+        }
+    }
+
+private:
+    std::ofstream file_;
+    std::vector<T> buffer_;
+};
+
+// Run I/O policies. Reader and Writer handle temp runs, OutputWriter the
+// final merge output, which must always be a plain file. Runs that are not
+// plain cannot be renamed into place as the output.
+
+// Page-cache backed run I/O.
+template <typename T>
+struct BufferedIo {
+    using Reader = RunReader<T>;
+    using Writer = BufferedWriter<T>;
+    using OutputWriter = BufferedWriter<T>;
+    static const bool plain_runs = true;
+};
+
+// Page-cache backed run I/O with encoded runs.
+template <typename T>
+struct CompressedIo {
+    using Reader = CompressedRunReader<T>;
+    using Writer = CompressedRunWriter<T>;
+    using OutputWriter = BufferedWriter<T>;
+    static const bool plain_runs = false;
+};
+
+// Tournament tree of losers over the heads of k runs. tree_[0] holds the
+// current winner, tree_[1..k-1] the loser of each internal match. After the
+// winner's run advances only its leaf-to-root path is replayed, so selecting
+// the next element costs log2(k) comparisons.
+template <typename T, typename KeyOf, typename Reader>
+class LoserTree {
+public:
+    explicit LoserTree(std::vector<Reader>& runs)
+            : runs_(runs), k_(runs.size()), tree_(runs.size()) {
+        if (k_ == 0) {
+            return;
+        }
+        std::vector<size_t> winners(2 * k_);
+        for (size_t i = 0; i < k_; ++i) {
+            winners[k_ + i] = i;
+        }
+        for (size_t node = k_ - 1; node > 0; --node) {
+            size_t a = winners[2 * node];
+            size_t b = winners[2 * node + 1];
+            if (less(b, a)) {
+                std::swap(a, b);
+            }
+            winners[node] = a;
+            tree_[node] = b;
+        }
+        tree_[0] = winners[1];
+    }
+
+    bool empty() const { return k_ == 0 || runs_[tree_[0]].exhausted(); }
+
+    size_t winner() const { return tree_[0]; }
+
+    void replay() {
+        size_t current = tree_[0];
+        for (size_t node = (current + k_) / 2; node > 0; node /= 2) {
+            if (less(tree_[node], current)) {
+                std::swap(tree_[node], current);
+            }
+        }
+        tree_[0] = current;
+    }
+
+private:
+    // Exhausted runs compare greater than everything else.
+    bool less(size_t a, size_t b) const {
+        if (runs_[a].exhausted()) {
+            return false;
+        }
+        if (runs_[b].exhausted()) {
+            return true;
+        }
+        return KeyLess<T, KeyOf>()(runs_[a].head(), runs_[b].head());
+    }
+
+    std::vector<Reader>& runs_;
+    size_t k_;
+    std::vector<size_t> tree_;
+};
+
+// Largest fan-in allowed by the open file limit, --fan-in and the merge
+// memory budget, which must give every run MIN_MERGE_READ_BUFFER_SIZE. With
+// direct I/O every run and the output also hold an AIO context.
+inline size_t max_merge_fan_in(const SortOptions& options) {
+    size_t fan_in = std::numeric_limits<size_t>::max();
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        fan_in = limit.rlim_cur > MERGE_RESERVED_FDS
+                         ? limit.rlim_cur - MERGE_RESERVED_FDS
+                         : 2;
+    }
+    if (options.io == IoBackend::Direct) {
+        size_t files = direct_file_limit();
+        fan_in = std::min(fan_in, files > 1 ? files - 1 : 2);
+    }
+    if (options.fan_in != 0) {
+        fan_in = std::min(fan_in, options.fan_in);
+    }
+    fan_in = std::min(fan_in, (merge_memory_budget(options) -
+                               merge_write_buffer_size(options)) /
+                                      MIN_MERGE_READ_BUFFER_SIZE);
+    return std::max<size_t>(2, fan_in);
+}
+
+// Number of passes needed to merge `runs` runs with at most max_fan_in at a
+// time, and the smallest fan-in that still gets there in that many passes.
+// A smaller fan-in leaves more buffer per run without costing a pass.
+inline size_t choose_merge_fan_in(size_t runs, size_t max_fan_in,
+                                  size_t& passes) {
+    auto reach = [runs](size_t fan_in, size_t depth) {
+        size_t covered = 1;
+        for (size_t d = 0; d < depth && covered < runs; ++d) {
+            covered = covered > runs / fan_in ? runs : covered * fan_in;
+        }
+        return covered;
+    };
+
+    passes = 1;
+    while (reach(max_fan_in, passes) < runs) {
+        ++passes;
+    }
+    size_t fan_in = 2;
+    while (reach(fan_in, passes) < runs) {
+        ++fan_in;
+    }
+    return fan_in;
+}
+
+template <typename T, typename KeyOf, typename Io,
+          typename Writer = typename Io::Writer>
+void merge_sorted_chunks(const std::vector<std::string>& chunk_filenames,
+                         const std::string& output_filename,
+                         const SortOptions& options) {
+    size_t read_buffer_size =
+            merge_read_buffer_size(options, chunk_filenames.size());
+    std::vector<typename Io::Reader> runs;
+    runs.reserve(chunk_filenames.size());
+    for (const auto& filename : chunk_filenames) {
+        runs.emplace_back(filename, read_buffer_size);
+    }
+
+    Writer output(output_filename, merge_write_buffer_size(options));
+    LoserTree<T, KeyOf, typename Io::Reader> tree(runs);
+    while (!tree.empty()) {
+        typename Io::Reader& run = runs[tree.winner()];
+        output.put(run.head());
+        run.advance();
+        tree.replay();
+    }
+}
+
+// Merges the runs in rounds of at most the chosen fan-in until one round can
+// produce the output. Each intermediate round merges balanced groups of
+// neighbouring runs into new temp runs. Input runs are removed once merged.
+template <typename T, typename KeyOf, typename Io>
+void merge_runs(std::vector<std::string> runs, const std::string& output_filename,
+                const SortOptions& options, SortStats& stats) {
+    stats.merge_passes = 0;
+    if (runs.size() == 1 && Io::plain_runs) {
+        std::filesystem::rename(runs[0], output_filename);
+        return;
+    }
+
+    size_t passes;
+    size_t fan_in = choose_merge_fan_in(runs.size(), max_merge_fan_in(options),
+                                        passes);
+    stats.fan_in = fan_in;
+
+    auto merge_start = std::chrono::steady_clock::now();
+    while (runs.size() > fan_in) {
+        ++stats.merge_passes;
+        size_t groups = (runs.size() + fan_in - 1) / fan_in;
+        std::vector<std::string> merged;
+        for (size_t g = 0; g < groups; ++g) {
+            std::vector<std::string> group(runs.begin() + runs.size() * g / groups,
+                                           runs.begin() +
+                                                   runs.size() * (g + 1) / groups);
+            std::string merged_filename = "temp_merge_" +
+                                          std::to_string(stats.merge_passes) +
+                                          "_" + std::to_string(g) + ".bin";
+            merge_sorted_chunks<T, KeyOf, Io>(group, merged_filename, options);
+            for (const auto& filename : group) {
+                remove(filename.c_str());
+            }
+            merged.push_back(merged_filename);
+        }
+        runs = std::move(merged);
+    }
+    stats.phases.merge_seconds += seconds_since(merge_start);
+
+    auto write_start = std::chrono::steady_clock::now();
+    ++stats.merge_passes;
+    merge_sorted_chunks<T, KeyOf, Io, typename Io::OutputWriter>(
+            runs, output_filename, options);
+    for (const auto& filename : runs) {
+        remove(filename.c_str());
+    }
+    stats.phases.write_seconds += seconds_since(write_start);
+}
+
+// Below this many elements splitting a sort across threads costs more than
+// it saves.
+const size_t PARALLEL_SORT_MIN_ELEMENTS = 64 * 1024;
+
+// Sorts `threads` slices concurrently, then merges neighbouring slices
+// pairwise, each round in parallel, until one sorted range is left.
+template <typename Iterator, typename Compare>
+void parallel_sort(Iterator first, Iterator last, Compare comp, unsigned threads) {
+    size_t n = static_cast<size_t>(last - first);
+    if (threads <= 1 || n < PARALLEL_SORT_MIN_ELEMENTS) {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    std::vector<size_t> bounds;
+    for (unsigned t = 0; t <= threads; ++t) {
+        bounds.push_back(n * t / threads);
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([=] {
+            std::sort(first + bounds[t], first + bounds[t + 1], comp);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged;
+        workers.clear();
+        for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+            size_t lo = bounds[i], mid = bounds[i + 1], hi = bounds[i + 2];
+            workers.emplace_back([=] {
+                std::inplace_merge(first + lo, first + mid, first + hi, comp);
+            });
+            merged.push_back(lo);
+        }
+        if (bounds.size() % 2 == 0) {
+            merged.push_back(bounds[bounds.size() - 2]);
+        }
+        merged.push_back(bounds.back());
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        bounds = std::move(merged);
+    }
+}
+
+// True when KeyOf yields an integral key, so runs can be radix sorted.
+template <typename T, typename KeyOf>
+struct RadixSortable
+        : std::is_integral<typename std::decay<
+                  typename std::invoke_result<KeyOf, const T&>::type>::type> {};
+
+template <typename T, typename KeyOf>
+bool uses_radix_sort(const SortOptions& options) {
+    return RadixSortable<T, KeyOf>::value && options.run_sort == RunSort::Auto;
+}
+
+// Sorts one in-memory run: radix sort for integral keys unless disabled,
+// parallel_sort otherwise.
+template <typename T, typename KeyOf>
+void sort_run(std::vector<T>& data, unsigned threads, RunSort run_sort) {
+    if constexpr (RadixSortable<T, KeyOf>::value) {
+        if (run_sort == RunSort::Auto && data.size() >= RADIX_SORT_MIN_ELEMENTS) {
+            std::vector<T> scratch(data.size());
+            radix_sort(data.data(), scratch.data(), data.size(), KeyOf(), threads);
+            return;
+        }
+    }
+    parallel_sort(data.begin(), data.end(), KeyLess<T, KeyOf>(), threads);
+}
+
+// Reads up to `count` elements from the current position of `input`.
+template <typename T>
+std::vector<T> read_chunk(std::ifstream& input, size_t count) {
+    std::vector<T> chunk(count);
+    input.read(reinterpret_cast<char*>(chunk.data()), count * sizeof(T));
+    chunk.resize(static_cast<size_t>(input.gcount()) / sizeof(T));
+    return chunk;
+}
+
+// Writes a sorted chunk out as a run and returns the seconds it took.
+template <typename T, typename Io>
+double spill_run(const std::vector<T>& chunk, const std::string& filename,
+                 size_t spill_buffer) {
+    auto start = std::chrono::steady_clock::now();
+    {
+        typename Io::Writer run(filename, spill_buffer);
+        run.write(chunk.data(), chunk.size());
+    }
+    return seconds_since(start);
+}
+
+// Run generation pipeline in three stages: this thread reads chunk after
+// chunk, pool workers sort them, and a spill thread writes each sorted chunk
+// out as a run. Reading chunk N+1, sorting chunk N and spilling chunk N-1
+// overlap even with a single pool worker. A chunk is held from its read until
+// its run is written, and at most pool.size() + 2 are held at a time, as
+// run_chunk_size() budgets for. Each worker sorts its chunk with
+// sort_threads threads; the sort and spill times come back through the
+// chunk's futures.
+template <typename T, typename KeyOf, typename Io>
+std::vector<std::string> generate_runs(const std::string& input_filename,
+                                       size_t chunk_elements, ThreadPool& pool,
+                                       unsigned sort_threads, RunSort run_sort,
+                                       size_t spill_buffer, SortPhases& phases) {
+    std::ifstream input(input_filename, std::ios::binary);
+    if (!input.is_open()) {
+        std::cerr << "Error opening file for reading: " << input_filename
+                  << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+
+    // A sort task hands its chunk to the spill thread and returns the
+    // spill's future.
+    ThreadPool spill_pool(1);
+    std::vector<std::string> chunk_filenames;
+    std::deque<std::future<std::future<SortPhases>>> in_flight;
+    auto finish_oldest = [&] {
+        std::future<std::future<SortPhases>> sorted = std::move(in_flight.front());
+        in_flight.pop_front();
+        phases += sorted.get().get();
+    };
+    try {
+        for (size_t j = 0;; j += chunk_elements) {
+            // With the chunk about to be read, pool.size() + 2 are held.
+            while (in_flight.size() > pool.size() + 1) {
+                finish_oldest();
+            }
+            auto read_start = std::chrono::steady_clock::now();
+            std::vector<T> chunk = read_chunk<T>(input, chunk_elements);
+            phases.read_seconds += seconds_since(read_start);
+            if (chunk.empty()) {
+                break;
+            }
+
+            std::string chunk_filename = "temp_chunk_" + std::to_string(j) + ".bin";
+            chunk_filenames.push_back(chunk_filename);
+            in_flight.push_back(pool.submit(
+                    [chunk = std::move(chunk), chunk_filename, sort_threads,
+                     run_sort, spill_buffer, &spill_pool]() mutable {
+                        auto sort_start = std::chrono::steady_clock::now();
+                        sort_run<T, KeyOf>(chunk, sort_threads, run_sort);
+                        double sort_seconds = seconds_since(sort_start);
+                        return spill_pool.submit(
+                                [chunk = std::move(chunk), chunk_filename,
+                                 spill_buffer, sort_seconds]() {
+                                    SortPhases task_phases;
+                                    task_phases.sort_seconds = sort_seconds;
+                                    task_phases.spill_seconds = spill_run<T, Io>(
+                                            chunk, chunk_filename, spill_buffer);
+                                    return task_phases;
+                                });
+                    }));
+        }
+        while (!in_flight.empty()) {
+            finish_oldest();
+        }
+    } catch (...) {
+        // Sort tasks still running would submit to spill_pool after it is
+        // gone.
+        for (auto& sorted : in_flight) {
+            sorted.wait();
+        }
+        throw;
+    }
+    return chunk_filenames;
+}
+
+// Replacement selection over a buffer of heap_elements elements. The front
+// of the buffer is a min-heap feeding the current run: its smallest element
+// is written out and replaced by the next input element. An element smaller
+// than the one just written cannot extend the current run, so the heap
+// shrinks by one and the element is parked right behind it for the next run.
+// When the heap runs dry the parked elements become the next run's heap.
+// On random input runs come out about twice the buffer size, and already
+// sorted input becomes a single run. The input is read through a buffer of
+// io_buffer bytes and each run written through another one.
+template <typename T, typename KeyOf, typename Io>
+std::vector<std::string> generate_runs_replacement(
+        const std::string& input_filename, size_t heap_elements,
+        size_t io_buffer) {
+    // std::push_heap builds a max-heap, so order elements by "greater".
+    auto greater = [](const T& a, const T& b) { return KeyLess<T, KeyOf>()(b, a); };
+
+    RunReader<T> input(input_filename, io_buffer);
+    std::vector<T> buffer;
+    buffer.reserve(heap_elements);
+    while (buffer.size() < heap_elements && !input.exhausted()) {
+        buffer.push_back(input.head());
+        input.advance();
+    }
+
+    // buffer[0, heap_size) is the heap, buffer[heap_size, filled) the elements
+    // parked for the next run.
+    size_t filled = buffer.size();
+    size_t heap_size = 0;
+    std::vector<std::string> run_filenames;
+    std::unique_ptr<typename Io::Writer> output;
+    while (filled > 0) {
+        if (heap_size == 0) {
+            heap_size = filled;
+            std::make_heap(buffer.begin(), buffer.begin() + heap_size, greater);
+            run_filenames.push_back("temp_chunk_" +
+                                    std::to_string(run_filenames.size()) + ".bin");
+            output.reset();
+            output = std::make_unique<typename Io::Writer>(run_filenames.back(),
+                                                           io_buffer);
+        }
+
+        std::pop_heap(buffer.begin(), buffer.begin() + heap_size, greater);
+        size_t slot = heap_size - 1;
+        output->put(buffer[slot]);
+
+        if (input.exhausted()) {
+            // Close the gap between the heap and the parked elements.
+            buffer[slot] = buffer[filled - 1];
+            --filled;
+            --heap_size;
+        } else if (KeyLess<T, KeyOf>()(input.head(), buffer[slot])) {
+            buffer[slot] = input.head();
+            --heap_size;
+            input.advance();
+        } else {
+            buffer[slot] = input.head();
+            std::push_heap(buffer.begin(), buffer.begin() + heap_size, greater);
+            input.advance();
+        }
+    }
+    return run_filenames;
+}
+
+// Sorts chunk-sized pieces of the input in memory, spills them as sorted runs
+// and merges the runs into the output. The input is streamed one chunk at a
+// time, so memory stays within the budget run_chunk_size() splits up
+// regardless of the file size. Run generation is spread over `threads` workers; when there
+// are fewer chunks than workers the spare threads go to sorting inside each
+// chunk.
+template <typename T, typename KeyOf, typename Io>
+SortStats chunked_sort_file(const std::string& input_filename,
+                            const std::string& output_filename,
+                            const SortOptions& options) {
+    SortStats stats;
+    size_t chunk_size = run_chunk_size(options, uses_radix_sort<T, KeyOf>(options));
+    unsigned threads = options.threads;
+    size_t chunk_elements = std::max<size_t>(1, chunk_size / sizeof(T));
+    size_t file_elements = std::filesystem::file_size(input_filename) / sizeof(T);
+
+    if (file_elements <= chunk_elements) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<T> data = read_binary_file<T>(input_filename);
+        stats.phases.read_seconds = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        sort_run<T, KeyOf>(data, threads, options.run_sort);
+        stats.phases.sort_seconds = seconds_since(start);
+        start = std::chrono::steady_clock::now();
+        write_binary_file(output_filename, data);
+        stats.phases.write_seconds = seconds_since(start);
+        stats.runs = 1;
+
+    } else {
+        std::vector<std::string> chunk_filenames;
+        if (options.run_generation == RunGeneration::ReplacementSelection) {
+            // Single-threaded, so the budget left by the input and spill
+            // buffers goes to the heap.
+            SortOptions single = options;
+            single.threads = 1;
+            size_t io_buffer = spill_buffer_size(single);
+            size_t heap_bytes = options.mem_limit == 0
+                                        ? options.chunk_size
+                                        : std::min(options.chunk_size,
+                                                   options.mem_limit - 2 * io_buffer);
+            auto start = std::chrono::steady_clock::now();
+            chunk_filenames = generate_runs_replacement<T, KeyOf, Io>(
+                    input_filename, std::max<size_t>(1, heap_bytes / sizeof(T)),
+                    io_buffer);
+            stats.phases.sort_seconds = seconds_since(start);
+        } else {
+            size_t chunks = (file_elements + chunk_elements - 1) / chunk_elements;
+            unsigned sort_threads = std::max<unsigned>(
+                    1, threads / std::min<size_t>(chunks, threads));
+            ThreadPool pool(threads);
+            chunk_filenames = generate_runs<T, KeyOf, Io>(
+                    input_filename, chunk_elements, pool, sort_threads,
+                    options.run_sort, spill_buffer_size(options), stats.phases);
+        }
+        stats.runs = chunk_filenames.size();
+
+        // The merge streams straight into a temp file next to the output and
+        // renames it into place, so readers never see a half-written result.
+        std::string merged_filename = output_filename + ".tmp";
+        merge_runs<T, KeyOf, Io>(chunk_filenames, merged_filename, options, stats);
+        auto rename_start = std::chrono::steady_clock::now();
+        std::filesystem::rename(merged_filename, output_filename);
+        stats.phases.write_seconds += seconds_since(rename_start);
+    }
+    return stats;
+}
+
+template <typename T, typename KeyOf = IdentityKey<T>>
+SortStats chunked_sort_file(const std::string& input_filename,
+                            const std::string& output_filename,
+                            const SortOptions& options) {
+    if (options.io == IoBackend::Direct) {
+        return chunked_sort_file<T, KeyOf, DirectIo<T>>(input_filename,
+                                                        output_filename, options);
+    }
+    if (options.codec == RunCodec::Delta) {
+        RunCodecStats& codec = run_codec_stats();
+        codec.reset();
+        SortStats stats = chunked_sort_file<T, KeyOf, CompressedIo<T>>(
+                input_filename, output_filename, options);
+        stats.spilled_runs = codec.runs;
+        stats.spill_raw_bytes = codec.raw_bytes;
+        stats.spill_encoded_bytes = codec.encoded_bytes;
+        stats.encode_seconds = codec.encode_ns / 1e9;
+        stats.decode_seconds = codec.decode_ns / 1e9;
+        return stats;
+    }
+    return chunked_sort_file<T, KeyOf, BufferedIo<T>>(input_filename,
+                                                      output_filename, options);
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Persistent set of 64-bit line fingerprints for incremental dedup.
+//
+// An index at PATH is two files. PATH is an open-addressing table (linear
+// probing, 0 marks an empty slot, at most half full) behind a small header.
+// It is mapped on load and probed in place, so loading costs O(1) however
+// many lines it holds. New fingerprints are kept in memory until save(),
+// which writes them into the mapped table at the end of every run. PATH.log
+// is the redo journal for that one batch: save() first appends the batch
+// with a commit record and syncs it, then fills in the table, syncs it and
+// empties the log. A crash after the commit leaves the batch in the log and
+// the next load writes it into the table again, which is harmless since a
+// fingerprint always lands in the same free slot or finds itself there. A
+// batch torn before its commit is ignored.
+//
+// A run therefore costs time in proportion to its new lines. When a batch
+// would fill the table past half, save() instead writes table and batch to
+// a table twice the size and renames it over the old one, an amortised
+// O(1) per fingerprint.
+//
+// Two different lines share a fingerprint with probability 2^-64 per pair;
+// the later one is then taken as already seen.
+
+const char FINGERPRINT_INDEX_MAGIC[8] = {'D', 'D', 'I', 'N', 'D', 'E', 'X', '1'};
+const uint64_t FINGERPRINT_LOG_COMMIT = 0x4c4f47434f4d4954ULL;
+const size_t FINGERPRINT_INDEX_MIN_CAPACITY = 1024;
+
+struct FingerprintIndexHeader {
+    char magic[8];
+    uint64_t capacity;  // slots, a power of two
+    uint64_t count;
+    uint64_t reserved;
+};
+
+// Fingerprint of a line hash. 0 marks empty slots and the commit record
+// marks batch ends, so neither is ever a fingerprint.
+inline uint64_t fingerprint_of(uint64_t hash) {
+    if (hash == 0 || hash == FINGERPRINT_LOG_COMMIT) {
+        return hash ^ 1;
+    }
+    return hash;
+}
+
+// Probes a table of `mask + 1` slots for `fingerprint`. Returns the slot
+// that holds it or the empty slot where it belongs.
+inline size_t fingerprint_slot(const uint64_t* slots, size_t mask,
+                               uint64_t fingerprint) {
+    size_t slot = static_cast<size_t>(fingerprint) & mask;
+    while (slots[slot] != 0 && slots[slot] != fingerprint) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Growable in-memory table with the same layout, for the batch of a run.
+class FingerprintSet {
+public:
+    FingerprintSet() : slots_(FINGERPRINT_INDEX_MIN_CAPACITY) {}
+
+    bool contains(uint64_t fingerprint) const {
+        return slots_[fingerprint_slot(slots_.data(), slots_.size() - 1,
+                                       fingerprint)] != 0;
+    }
+
+    bool insert(uint64_t fingerprint) {
+        if ((size_ + 1) * 2 > slots_.size()) {
+            std::vector<uint64_t> old(slots_.size() * 2);
+            old.swap(slots_);
+            for (uint64_t value : old) {
+                if (value != 0) {
+                    slots_[fingerprint_slot(slots_.data(), slots_.size() - 1, value)] =
+                            value;
+                }
+            }
+        }
+        uint64_t& slot =
+                slots_[fingerprint_slot(slots_.data(), slots_.size() - 1, fingerprint)];
+        if (slot != 0) {
+            return false;
+        }
+        slot = fingerprint;
+        ++size_;
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+    const std::vector<uint64_t>& slots() const { return slots_; }
+
+private:
+    std::vector<uint64_t> slots_;
+    size_t size_ = 0;
+};
+
+class FingerprintIndex {
+public:
+    // Opens the index at `path`; a missing index is empty. A batch left in
+    // the log by an interrupted save is written into the table first.
+    explicit FingerprintIndex(const std::string& path)
+            : path_(path), log_path_(path + ".log") {
+        map_table();
+        replay_log();
+    }
+
+    ~FingerprintIndex() { unmap_table(); }
+
+    FingerprintIndex(const FingerprintIndex&) = delete;
+    FingerprintIndex& operator=(const FingerprintIndex&) = delete;
+
+    bool contains(uint64_t fingerprint) const {
+        return in_table(fingerprint) || pending_.contains(fingerprint);
+    }
+
+    // Adds the fingerprint unless it is present. Returns true if it was
+    // added. Nothing is stored until save().
+    bool insert(uint64_t fingerprint) {
+        if (in_table(fingerprint)) {
+            return false;
+        }
+        return pending_.insert(fingerprint);
+    }
+
+    size_t size() const { return table_count_ + pending_.size(); }
+
+    // Makes every insert so far durable, all of them or none.
+    void save() {
+        if (pending_.size() == 0) {
+            return;
+        }
+        std::vector<uint64_t> batch;
+        batch.reserve(pending_.size());
+        for (uint64_t fingerprint : pending_.slots()) {
+            if (fingerprint != 0) {
+                batch.push_back(fingerprint);
+            }
+        }
+        append_log(batch);
+        apply(batch, table_count_);
+        pending_ = FingerprintSet();
+    }
+
+private:
+    bool in_table(uint64_t fingerprint) const {
+        return slots_ != nullptr &&
+               slots_[fingerprint_slot(slots_, table_mask_, fingerprint)] != 0;
+    }
+
+    void fail(const std::string& what, const std::string& filename) {
+        std::cerr << "Error " << what << ": " << filename << " - " << strerror(errno)
+                  << std::endl;
+        throw std::runtime_error("Error " + what);
+    }
+
+    void map_table() {
+        int fd = ::open(path_.c_str(), O_RDWR);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                return;
+            }
+            fail("opening index", path_);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            fail("reading index", path_);
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* data = size >= sizeof(FingerprintIndexHeader)
+                             ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0)
+                             : MAP_FAILED;
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << "Error mapping index: " << path_ << std::endl;
+            throw std::runtime_error("Error mapping index");
+        }
+        map_ = data;
+        map_size_ = size;
+        header_ = static_cast<FingerprintIndexHeader*>(data);
+        uint64_t capacity = header_->capacity;
+        if (std::memcmp(header_->magic, FINGERPRINT_INDEX_MAGIC, 8) != 0 ||
+            capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+            size != sizeof(FingerprintIndexHeader) + capacity * sizeof(uint64_t)) {
+            unmap_table();
+            std::cerr << "Not a dedup index: " << path_ << std::endl;
+            throw std::runtime_error("Not a dedup index");
+        }
+        slots_ = reinterpret_cast<uint64_t*>(header_ + 1);
+        table_mask_ = static_cast<size_t>(capacity - 1);
+        table_count_ = static_cast<size_t>(header_->count);
+        // Lookups are random.
+        madvise(map_, map_size_, MADV_RANDOM);
+    }
+
+    void unmap_table() {
+        if (map_ != nullptr) {
+            munmap(map_, map_size_);
+            map_ = nullptr;
+        }
+        header_ = nullptr;
+        slots_ = nullptr;
+        table_mask_ = 0;
+        table_count_ = 0;
+    }
+
+    // Writes a committed batch left in the log into the table. A torn one
+    // is dropped.
+    void replay_log() {
+        FILE* file = std::fopen(log_path_.c_str(), "rb");
+        if (file == nullptr) {
+            if (errno == ENOENT) {
+                return;
+            }
+            fail("opening index log", log_path_);
+        }
+        std::vector<uint64_t> batch;
+        uint64_t record;
+        uint64_t trailer[3];
+        bool committed = false;
+        while (std::fread(&record, sizeof(record), 1, file) == 1) {
+            if (record != FINGERPRINT_LOG_COMMIT) {
+                batch.push_back(record);
+                continue;
+            }
+            committed = std::fread(trailer, sizeof(trailer), 1, file) == 1 &&
+                        trailer[0] == batch.size() && trailer[2] == checksum(batch);
+            break;
+        }
+        std::fclose(file);
+        if (committed) {
+            apply(batch, static_cast<size_t>(trailer[1]));
+        } else {
+            std::filesystem::resize_file(log_path_, 0);
+        }
+    }
+
+    static uint64_t checksum(const std::vector<uint64_t>& fingerprints) {
+        uint64_t sum = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t fingerprint : fingerprints) {
+            sum = (sum ^ fingerprint) * 0xd6e8feb86659fd93ULL;
+        }
+        return sum;
+    }
+
+    static void write_all(int fd, const void* data, size_t size,
+                          const std::string& filename) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::write(fd, bytes, size);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error writing to file: " << filename << " - "
+                          << strerror(errno) << std::endl;
+                throw std::runtime_error("Error writing to file");
+            }
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    // Journals the batch: its fingerprints, then the commit record with the
+    // batch size, the table count it applies to and a checksum.
+    void append_log(const std::vector<uint64_t>& batch) {
+        int fd = ::open(log_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fail("opening index log", log_path_);
+        }
+        uint64_t trailer[4] = {FINGERPRINT_LOG_COMMIT, batch.size(), table_count_,
+                               checksum(batch)};
+        try {
+            write_all(fd, batch.data(), batch.size() * sizeof(uint64_t), log_path_);
+            write_all(fd, trailer, sizeof(trailer), log_path_);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        if (fsync(fd) == -1) {
+            ::close(fd);
+            fail("syncing index log", log_path_);
+        }
+        ::close(fd);
+    }
+
+    // Writes a journaled batch into the table, which held base_count
+    // fingerprints before it, and empties the log. None of the batch was in
+    // the table then, so afterwards it holds base_count + batch.size()
+    // however much of the batch an interrupted save had already written.
+    void apply(const std::vector<uint64_t>& batch, size_t base_count) {
+        size_t count = base_count + batch.size();
+        if (slots_ == nullptr || count * 2 > table_mask_ + 1) {
+            rebuild(batch, count);
+        } else {
+            for (uint64_t fingerprint : batch) {
+                slots_[fingerprint_slot(slots_, table_mask_, fingerprint)] = fingerprint;
+            }
+            header_->count = count;
+            table_count_ = count;
+            if (msync(map_, map_size_, MS_SYNC) == -1) {
+                fail("syncing index", path_);
+            }
+        }
+        std::filesystem::resize_file(log_path_, 0);
+    }
+
+    // Writes table + batch into a new table with room for them at most half
+    // full and renames it over the old one.
+    void rebuild(const std::vector<uint64_t>& batch, size_t count) {
+        size_t capacity = FINGERPRINT_INDEX_MIN_CAPACITY;
+        while (capacity < count * 2) {
+            capacity *= 2;
+        }
+        std::vector<uint64_t> slots(capacity);
+        auto add = [&](uint64_t fingerprint) {
+            slots[fingerprint_slot(slots.data(), capacity - 1, fingerprint)] = fingerprint;
+        };
+        for (size_t i = 0; slots_ != nullptr && i <= table_mask_; ++i) {
+            if (slots_[i] != 0) {
+                add(slots_[i]);
+            }
+        }
+        for (uint64_t fingerprint : batch) {
+            add(fingerprint);
+        }
+
+        FingerprintIndexHeader header = {};
+        std::memcpy(header.magic, FINGERPRINT_INDEX_MAGIC, 8);
+        header.capacity = capacity;
+        header.count = count;
+        std::string temp_path = path_ + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fail("opening index", temp_path);
+        }
+        try {
+            write_all(fd, &header, sizeof(header), temp_path);
+            write_all(fd, slots.data(), capacity * sizeof(uint64_t), temp_path);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        if (fsync(fd) == -1) {
+            ::close(fd);
+            fail("syncing index", temp_path);
+        }
+        ::close(fd);
+        if (std::rename(temp_path.c_str(), path_.c_str()) == -1) {
+            fail("renaming index", temp_path);
+        }
+        // The rename is only durable once the directory is synced.
+        std::string directory = std::filesystem::path(path_).parent_path().string();
+        int dir_fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            ::close(dir_fd);
+        }
+
+        unmap_table();
+        map_table();
+    }
+
+    std::string path_;
+    std::string log_path_;
+    void* map_ = nullptr;
+    size_t map_size_ = 0;
+    FingerprintIndexHeader* header_ = nullptr;
+    uint64_t* slots_ = nullptr;
+    size_t table_mask_ = 0;
+    size_t table_count_ = 0;
+    FingerprintSet pending_;  // inserted since the last save
+};
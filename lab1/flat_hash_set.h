@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Open-addressing set of lines in the style of a Swiss table. Every slot
+// has a control byte: FLAT_SET_EMPTY, or the low 7 bits of the line's hash.
+// A lookup loads 16 control bytes at once and only looks at slots whose
+// byte matches, then compares the stored 64-bit hash before touching the
+// line itself. Slots hold the hash, a view of the line and a value for the
+// caller; the bytes live in the caller's arena or mapping, so inserting
+// never allocates except when the table grows, and growing never rehashes a
+// line.
+//
+// Nothing is ever erased, so there are no tombstones: a probe stops at the
+// first group with an empty slot.
+
+const size_t FLAT_SET_GROUP_SIZE = 16;
+const int8_t FLAT_SET_EMPTY = -128;
+
+class FlatLineSet {
+public:
+    explicit FlatLineSet(size_t expected = 0) { reserve(expected); }
+
+    // Sizes the table so that `expected` lines fit without growing.
+    void reserve(size_t expected) {
+        size_t capacity = FLAT_SET_GROUP_SIZE;
+        while (capacity / 8 * 7 < expected) {
+            capacity *= 2;
+        }
+        if (ctrl_.empty() || capacity > mask_ + 1) {
+            rehash(capacity);
+        }
+    }
+
+    // Adds the line unless an equal one is already present. Returns true if
+    // it was added. `text` must stay valid for as long as the set is used.
+    bool insert(uint64_t hash, std::string_view text) {
+        bool added;
+        find_or_insert(hash, text, [](std::string_view line) { return line; },
+                       added);
+        return added;
+    }
+
+    // Every line carries a 64-bit value for the caller, 0 when added. Finds
+    // the line, or adds it as keep(text), a view of it that stays valid
+    // (e.g. a copy in an arena); lines already present are never passed to
+    // keep. Returns the line's value, valid until the next insert.
+    template <typename Keep>
+    uint64_t& find_or_insert(uint64_t hash, std::string_view text, Keep&& keep,
+                             bool& added) {
+        if (growth_left_ == 0) {
+            rehash((mask_ + 1) * 2);
+        }
+        size_t index;
+        added = !find(hash, text, index);
+        if (added) {
+            place(index, hash, keep(text), 0);
+            --growth_left_;
+            ++size_;
+        }
+        return slots_[index].value;
+    }
+
+    // Calls f(text, value) for every line, in table order.
+    template <typename F>
+    void for_each(F&& f) const {
+        for (size_t i = 0; i <= mask_ && !slots_.empty(); ++i) {
+            if (ctrl_[i] != FLAT_SET_EMPTY) {
+                f(std::string_view(slots_[i].data, slots_[i].size), slots_[i].value);
+            }
+        }
+    }
+
+    bool contains(uint64_t hash, std::string_view text) const {
+        size_t index;
+        return find(hash, text, index);
+    }
+
+    size_t size() const { return size_; }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Slot {
+        uint64_t hash;
+        const char* data;
+        size_t size;
+        uint64_t value;
+    };
+
+    static int8_t control_of(uint64_t hash) {
+        return static_cast<int8_t>(hash & 0x7f);
+    }
+
+    // Bit i is set if control byte pos + i equals `value`.
+    uint32_t match(size_t pos, int8_t value) const {
+#if defined(__SSE2__)
+        __m128i group = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(ctrl_.data() + pos));
+        return static_cast<uint32_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < FLAT_SET_GROUP_SIZE; ++i) {
+            bits |= static_cast<uint32_t>(ctrl_[pos + i] == value) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Looks the line up. On a miss, `index` is the empty slot it belongs in.
+    bool find(uint64_t hash, std::string_view text, size_t& index) const {
+        int8_t control = control_of(hash);
+        size_t pos = static_cast<size_t>(hash >> 7) & mask_;
+        for (size_t stride = FLAT_SET_GROUP_SIZE;; stride += FLAT_SET_GROUP_SIZE) {
+            for (uint32_t bits = match(pos, control); bits != 0; bits &= bits - 1) {
+                size_t candidate = (pos + __builtin_ctz(bits)) & mask_;
+                const Slot& slot = slots_[candidate];
+                if (slot.hash == hash && slot.size == text.size() &&
+                    std::string_view(slot.data, slot.size) == text) {
+                    index = candidate;
+                    return true;
+                }
+            }
+            uint32_t empty = match(pos, FLAT_SET_EMPTY);
+            if (empty != 0) {
+                index = (pos + __builtin_ctz(empty)) & mask_;
+                return false;
+            }
+            pos = (pos + stride) & mask_;
+        }
+    }
+
+    void place(size_t index, uint64_t hash, std::string_view text, uint64_t value) {
+        int8_t control = control_of(hash);
+        ctrl_[index] = control;
+        // The first group is mirrored past the end, so a group load that
+        // starts near the end of the table wraps around.
+        if (index < FLAT_SET_GROUP_SIZE) {
+            ctrl_[mask_ + 1 + index] = control;
+        }
+        slots_[index] = {hash, text.data(), text.size(), value};
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<int8_t> old_ctrl(capacity + FLAT_SET_GROUP_SIZE, FLAT_SET_EMPTY);
+        std::vector<Slot> old_slots(capacity);
+        old_ctrl.swap(ctrl_);
+        old_slots.swap(slots_);
+        mask_ = capacity - 1;
+        growth_left_ = capacity / 8 * 7 - size_;
+
+        for (size_t i = 0; i + FLAT_SET_GROUP_SIZE < old_ctrl.size(); ++i) {
+            if (old_ctrl[i] == FLAT_SET_EMPTY) {
+                continue;
+            }
+            const Slot& slot = old_slots[i];
+            size_t pos = static_cast<size_t>(slot.hash >> 7) & mask_;
+            uint32_t empty;
+            for (size_t stride = FLAT_SET_GROUP_SIZE;
+                 (empty = match(pos, FLAT_SET_EMPTY)) == 0;
+                 stride += FLAT_SET_GROUP_SIZE) {
+                pos = (pos + stride) & mask_;
+            }
+            place((pos + __builtin_ctz(empty)) & mask_, slot.hash,
+                  std::string_view(slot.data, slot.size), slot.value);
+        }
+    }
+
+    std::vector<int8_t> ctrl_;
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+    size_t growth_left_ = 0;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "external_sort.h"
+
+// Input generator for ema-sort-int benchmarks. The file is produced in
+// fixed-size blocks, each from its own xoshiro256** stream seeded from the
+// run seed and the block index, so the same seed gives the same file for any
+// number of generator threads.
+
+const size_t GENERATE_BLOCK_SIZE = 1024 * 1024;
+const size_t FEW_UNIQUE_KEYS = 16;
+const size_t ZIPF_RANKS = 1 << 16;
+
+enum class Distribution {
+    Uniform,    // independent uniform elements
+    Sorted,     // non-decreasing keys
+    Reverse,    // non-increasing keys
+    FewUnique,  // FEW_UNIQUE_KEYS distinct keys
+    Zipf,       // keys drawn from ZIPF_RANKS ranks with Zipf(s = 1) frequencies
+};
+
+inline bool parse_distribution(const std::string& name, Distribution& distribution) {
+    if (name == "uniform") {
+        distribution = Distribution::Uniform;
+    } else if (name == "sorted") {
+        distribution = Distribution::Sorted;
+    } else if (name == "reverse") {
+        distribution = Distribution::Reverse;
+    } else if (name == "few-unique") {
+        distribution = Distribution::FewUnique;
+    } else if (name == "zipf") {
+        distribution = Distribution::Zipf;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// xoshiro256**: 64 random bits per step.
+class Xoshiro256 {
+public:
+    explicit Xoshiro256(uint64_t seed) {
+        for (auto& word : state_) {
+            word = splitmix64(seed);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(state_[1] * 5, 7) * 9;
+        uint64_t t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+
+    // Uniform double in [0, 1).
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t state_[4];
+};
+
+// Builds an element whose key grows with `ordinal`, filling any non-key bytes
+// from `rng`. Every distribution except uniform is expressed as ordinals.
+template <typename T>
+struct OrdinalElement;
+
+template <>
+struct OrdinalElement<char> {
+    static char make(uint64_t ordinal, Xoshiro256&) {
+        return static_cast<char>(static_cast<int>(ordinal >> 56) - 128);
+    }
+};
+
+template <>
+struct OrdinalElement<int32_t> {
+    static int32_t make(uint64_t ordinal, Xoshiro256&) {
+        return static_cast<int32_t>((ordinal >> 32) ^ 0x80000000ULL);
+    }
+};
+
+template <>
+struct OrdinalElement<int64_t> {
+    static int64_t make(uint64_t ordinal, Xoshiro256&) {
+        return static_cast<int64_t>(ordinal ^ 0x8000000000000000ULL);
+    }
+};
+
+template <>
+struct OrdinalElement<uint64_t> {
+    static uint64_t make(uint64_t ordinal, Xoshiro256&) { return ordinal; }
+};
+
+inline void fill_random_bytes(unsigned char* bytes, size_t size, Xoshiro256& rng) {
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = rng.next();
+        std::memcpy(bytes + i, &word, std::min<size_t>(8, size - i));
+    }
+}
+
+template <>
+struct OrdinalElement<Record16> {
+    static Record16 make(uint64_t ordinal, Xoshiro256& rng) {
+        Record16 record;
+        std::memcpy(record.bytes, &ordinal, sizeof(ordinal));
+        fill_random_bytes(record.bytes + 8, 8, rng);
+        return record;
+    }
+};
+
+template <>
+struct OrdinalElement<Record100> {
+    static Record100 make(uint64_t ordinal, Xoshiro256& rng) {
+        Record100 record;
+        // The 10-byte key compares bytewise: big-endian ordinal, then zeros.
+        for (int i = 0; i < 8; ++i) {
+            record.bytes[i] = static_cast<unsigned char>(ordinal >> (56 - 8 * i));
+        }
+        record.bytes[8] = 0;
+        record.bytes[9] = 0;
+        fill_random_bytes(record.bytes + 10, 90, rng);
+        return record;
+    }
+};
+
+// Cumulative Zipf(s = 1) probabilities of ranks 1..ZIPF_RANKS.
+inline const std::vector<double>& zipf_cdf() {
+    static const std::vector<double> cdf = [] {
+        std::vector<double> values(ZIPF_RANKS);
+        double sum = 0;
+        for (size_t rank = 1; rank <= ZIPF_RANKS; ++rank) {
+            sum += 1.0 / static_cast<double>(rank);
+            values[rank - 1] = sum;
+        }
+        for (auto& value : values) {
+            value /= sum;
+        }
+        return values;
+    }();
+    return cdf;
+}
+
+// Generates elements [first, first + count) of a `total`-element input.
+template <typename T>
+void generate_block(T* out, size_t first, size_t count, size_t total,
+                    Distribution distribution, uint64_t seed) {
+    uint64_t block_state = first;
+    Xoshiro256 rng(seed ^ splitmix64(block_state));
+
+    if (distribution == Distribution::Uniform) {
+        // Every byte of every supported type is uniform: 8 bytes per step.
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(out);
+        size_t size = count * sizeof(T);
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word = rng.next();
+            std::memcpy(bytes + i, &word, 8);
+        }
+        if (i < size) {
+            uint64_t word = rng.next();
+            std::memcpy(bytes + i, &word, size - i);
+        }
+        return;
+    }
+
+    const std::vector<double>& cdf = zipf_cdf();
+    uint64_t step = total == 0 ? 0 : UINT64_MAX / total;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t ordinal = 0;
+        switch (distribution) {
+            case Distribution::Sorted:
+                ordinal = (first + i) * step;
+                break;
+            case Distribution::Reverse:
+                ordinal = (total - 1 - first - i) * step;
+                break;
+            case Distribution::FewUnique:
+                ordinal = (rng.next() % FEW_UNIQUE_KEYS) *
+                          (UINT64_MAX / FEW_UNIQUE_KEYS);
+                break;
+            case Distribution::Zipf: {
+                size_t rank = std::upper_bound(cdf.begin(), cdf.end(), rng.uniform()) -
+                              cdf.begin();
+                ordinal = static_cast<uint64_t>(std::min(rank, ZIPF_RANKS - 1)) *
+                          (UINT64_MAX / ZIPF_RANKS);
+                break;
+            }
+            case Distribution::Uniform:
+                break;
+        }
+        out[i] = OrdinalElement<T>::make(ordinal, rng);
+    }
+}
+
+// Writes size bytes (rounded down to whole elements) of generated input.
+// `threads` blocks are generated concurrently, then written in order.
+template <typename T>
+void generate_input_file(const std::string& filename, size_t size,
+                         Distribution distribution, uint64_t seed,
+                         unsigned threads) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        throw std::runtime_error("Error opening file");
+    }
+
+    threads = std::max(1u, threads);
+    size_t total = size / sizeof(T);
+    size_t block_elements = std::max<size_t>(1, GENERATE_BLOCK_SIZE / sizeof(T));
+    std::vector<std::vector<T>> blocks(threads, std::vector<T>(block_elements));
+    for (size_t first = 0; first < total;) {
+        std::vector<std::thread> workers;
+        std::vector<size_t> counts;
+        for (unsigned t = 0; t < threads && first < total; ++t) {
+            size_t count = std::min(block_elements, total - first);
+            T* out = blocks[t].data();
+            if (threads == 1) {
+                generate_block(out, first, count, total, distribution, seed);
+            } else {
+                workers.emplace_back(generate_block<T>, out, first, count, total,
+                                     distribution, seed);
+            }
+            counts.push_back(count);
+            first += count;
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (size_t t = 0; t < counts.size(); ++t) {
+            file.write(reinterpret_cast<const char*>(blocks[t].data()),
+                       counts[t] * sizeof(T));
+        }
+    }
+    file.close();
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// LSD radix sort for elements with an integral key. Keys are mapped to
+// order-preserving unsigned values and sorted one byte per pass, least
+// significant first; every pass is a stable counting scatter between the
+// data and a scratch buffer of the same size.
+//
+//   * all digit histograms come from a single read of the input, and a pass
+//     whose digit is the same for every element is skipped;
+//   * the scatter goes through a cache line of buffered elements per bucket,
+//     so each bucket's destination sees full-line writes instead of one
+//     store per element (software write-combining);
+//   * with several threads the array is split into contiguous blocks; each
+//     thread counts and scatters its own block, and the per-block offsets
+//     are laid out bucket by bucket, block by block, which keeps the sort
+//     stable.
+
+const size_t RADIX_BUCKETS = 256;
+// Below this many elements std::sort is faster than the histogram passes.
+const size_t RADIX_SORT_MIN_ELEMENTS = 4096;
+// Smallest block worth handing to a thread.
+const size_t RADIX_PARALLEL_MIN_ELEMENTS = 64 * 1024;
+// Bytes buffered per bucket before they are copied to the destination.
+const size_t RADIX_WRITE_COMBINE_SIZE = 64;
+
+// Key bits as an unsigned value that orders like the key.
+template <typename K>
+typename std::make_unsigned<K>::type radix_ordered_key(K key) {
+    using U = typename std::make_unsigned<K>::type;
+    U value = static_cast<U>(key);
+    if (std::is_signed<K>::value) {
+        value ^= static_cast<U>(U(1) << (8 * sizeof(U) - 1));
+    }
+    return value;
+}
+
+// Runs f(t) for t in [0, threads), on threads of their own when there is
+// more than one.
+template <typename F>
+void radix_for_each_block(unsigned threads, F f) {
+    if (threads == 1) {
+        f(0u);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back(f, t);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Stable scatter of src[begin, end) by the digit at `shift`. offsets[b] is
+// where the next element of bucket b goes.
+template <typename T, typename KeyOf>
+void radix_scatter(const T* src, size_t begin, size_t end, T* dst, size_t* offsets,
+                   unsigned shift, KeyOf key_of) {
+    constexpr size_t line = RADIX_WRITE_COMBINE_SIZE / sizeof(T);
+    if constexpr (line <= 1) {
+        for (size_t i = begin; i < end; ++i) {
+            size_t bucket = (radix_ordered_key(key_of(src[i])) >> shift) & 0xff;
+            dst[offsets[bucket]++] = src[i];
+        }
+    } else {
+        std::vector<T> lines(RADIX_BUCKETS * line);
+        std::array<size_t, RADIX_BUCKETS> fill{};
+        for (size_t i = begin; i < end; ++i) {
+            size_t bucket = (radix_ordered_key(key_of(src[i])) >> shift) & 0xff;
+            T* buffer = lines.data() + bucket * line;
+            buffer[fill[bucket]++] = src[i];
+            if (fill[bucket] == line) {
+                std::memcpy(dst + offsets[bucket], buffer, line * sizeof(T));
+                offsets[bucket] += line;
+                fill[bucket] = 0;
+            }
+        }
+        for (size_t bucket = 0; bucket < RADIX_BUCKETS; ++bucket) {
+            std::memcpy(dst + offsets[bucket], lines.data() + bucket * line,
+                        fill[bucket] * sizeof(T));
+            offsets[bucket] += fill[bucket];
+        }
+    }
+}
+
+// Sorts data[0, n) by key_of(element), using scratch[0, n) as the second
+// buffer. The result always ends up in data.
+template <typename T, typename KeyOf>
+void radix_sort(T* data, T* scratch, size_t n, KeyOf key_of, unsigned threads) {
+    using Key = typename std::decay<decltype(key_of(*data))>::type;
+    static_assert(std::is_integral<Key>::value, "radix sort needs an integral key");
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "elements are scattered as raw bytes");
+    constexpr unsigned passes = sizeof(Key);
+    using Histogram = std::array<size_t, RADIX_BUCKETS>;
+
+    threads = static_cast<unsigned>(std::max<size_t>(
+            1, std::min<size_t>(threads, n / RADIX_PARALLEL_MIN_ELEMENTS)));
+    std::vector<size_t> bounds;
+    for (unsigned t = 0; t <= threads; ++t) {
+        bounds.push_back(n * t / threads);
+    }
+
+    // counts[t][p]: digit p of the elements in block t. Only the first pass
+    // sees the blocks as they are now, later passes recount their block.
+    std::vector<std::array<Histogram, passes>> counts(threads);
+    radix_for_each_block(threads, [&](unsigned t) {
+        auto& block = counts[t];
+        for (auto& histogram : block) {
+            histogram.fill(0);
+        }
+        for (size_t i = bounds[t]; i < bounds[t + 1]; ++i) {
+            auto key = radix_ordered_key(key_of(data[i]));
+            for (unsigned p = 0; p < passes; ++p) {
+                ++block[p][(key >> (8 * p)) & 0xff];
+            }
+        }
+    });
+
+    T* src = data;
+    T* dst = scratch;
+    bool scattered = false;
+    for (unsigned p = 0; p < passes; ++p) {
+        unsigned shift = 8 * p;
+        bool trivial = false;
+        for (size_t bucket = 0; bucket < RADIX_BUCKETS && !trivial; ++bucket) {
+            size_t total = 0;
+            for (unsigned t = 0; t < threads; ++t) {
+                total += counts[t][p][bucket];
+            }
+            trivial = total == n;
+        }
+        if (trivial) {
+            continue;
+        }
+
+        if (threads > 1 && scattered) {
+            radix_for_each_block(threads, [&](unsigned t) {
+                Histogram& histogram = counts[t][p];
+                histogram.fill(0);
+                for (size_t i = bounds[t]; i < bounds[t + 1]; ++i) {
+                    ++histogram[(radix_ordered_key(key_of(src[i])) >> shift) & 0xff];
+                }
+            });
+        }
+
+        std::vector<Histogram> offsets(threads);
+        size_t next = 0;
+        for (size_t bucket = 0; bucket < RADIX_BUCKETS; ++bucket) {
+            for (unsigned t = 0; t < threads; ++t) {
+                offsets[t][bucket] = next;
+                next += counts[t][p][bucket];
+            }
+        }
+
+        radix_for_each_block(threads, [&](unsigned t) {
+            radix_scatter(src, bounds[t], bounds[t + 1], dst, offsets[t].data(),
+                          shift, key_of);
+        });
+        std::swap(src, dst);
+        scattered = true;
+    }
+
+    if (src != data) {
+        std::memcpy(data, src, n * sizeof(T));
+    }
+}
+
+// Sorts integers in place.
+template <typename T>
+void radix_sort(std::vector<T>& data, unsigned threads) {
+    std::vector<T> scratch(data.size());
+    radix_sort(data.data(), scratch.data(), data.size(),
+               [](const T& value) { return value; }, threads);
+}
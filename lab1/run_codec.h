@@ -0,0 +1,700 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Run codec for ema-sort-int's temp runs. A sorted run is mostly small steps
+// between neighbours, so runs are stored as a stream of variable-length
+// integers instead of raw elements:
+//
+//   * integral elements are mapped to order-preserving unsigned values and
+//     stored as groups of equal values: the step from the previous group and
+//     the group's repeat count. Sorted bytes collapse to a few hundred groups
+//     per run, sorted integers to a byte or two per element;
+//   * other elements (records) are front-coded: the number of leading bytes
+//     shared with the previous element, then the remaining bytes.
+//
+// The varint bytes are then cut into blocks of RUN_CODEC_BLOCK_SIZE, and
+// each block is entropy-coded with a static Huffman code of its own. Its
+// code lengths are stored with it. The varints leave the first bytes of
+// steps and repeat counts skewed towards small values, which the Huffman
+// stage squeezes. A block the code would not shrink is stored as is, so the
+// stage never costs more than its frame header.
+//
+// Readers decode a batch of elements at a time while the merge consumes the
+// previous batch, so a run never has to be expanded on disk.
+
+// Spill traffic through the codec since the last reset, summed over all
+// writers and readers of a sort.
+struct RunCodecStats {
+    std::atomic<uint64_t> runs{0};
+    std::atomic<uint64_t> raw_bytes{0};
+    std::atomic<uint64_t> encoded_bytes{0};
+    std::atomic<uint64_t> encode_ns{0};
+    std::atomic<uint64_t> decode_ns{0};
+
+    void reset() {
+        runs = 0;
+        raw_bytes = 0;
+        encoded_bytes = 0;
+        encode_ns = 0;
+        decode_ns = 0;
+    }
+};
+
+inline RunCodecStats& run_codec_stats() {
+    static RunCodecStats stats;
+    return stats;
+}
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count());
+}
+
+// LEB128: seven bits per byte, high bit set on all but the last byte.
+inline void put_varint(std::vector<unsigned char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+// Continues a varint whose low `shift` bits are already in `value`. Returns
+// false if [p, end) ends before the last byte.
+inline bool get_varint_tail(const unsigned char*& p, const unsigned char* end,
+                            uint64_t& value, unsigned shift) {
+    while (p != end) {
+        unsigned char byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+inline bool get_varint(const unsigned char*& p, const unsigned char* end,
+                       uint64_t& value) {
+    value = 0;
+    return get_varint_tail(p, end, value, 0);
+}
+
+const size_t RUN_CODEC_BLOCK_SIZE = 16 * 1024;
+// Codes are at most this long, so a decoder looks a symbol up in a table
+// of 2^HUFFMAN_MAX_CODE_LENGTH entries.
+const unsigned HUFFMAN_MAX_CODE_LENGTH = 11;
+// A Huffman block starts with its 256 code lengths, four bits each.
+const size_t HUFFMAN_LENGTHS_SIZE = 128;
+// A block is only coded if that saves at least 1/HUFFMAN_MIN_SAVING of it;
+// decoding costs more than copying, and steps of random keys hardly shrink.
+const size_t HUFFMAN_MIN_SAVING = 4;
+// Before counting a whole block, the encoder estimates its entropy from
+// every HUFFMAN_SAMPLE_STRIDE-th byte. The stride is odd, so it does not
+// keep landing on the same byte of fixed-size elements.
+const size_t HUFFMAN_SAMPLE_STRIDE = 7;
+
+using HuffmanLengths = std::array<uint8_t, 256>;
+using HuffmanTable = std::array<uint16_t, size_t(1) << HUFFMAN_MAX_CODE_LENGTH>;
+
+// Huffman code lengths for the byte counts, 0 for bytes that do not occur.
+// While the longest code is over HUFFMAN_MAX_CODE_LENGTH, the counts are
+// halved and the code is built again; they end up equal at worst, which
+// gives every byte 8 bits.
+inline HuffmanLengths huffman_lengths(const std::array<uint64_t, 256>& counts) {
+    HuffmanLengths lengths{};
+    // Leaves by count. Halving keeps their order, so they are sorted once.
+    std::pair<uint64_t, int> leaves[256];
+    size_t n = 0;
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        if (counts[symbol] > 0) {
+            leaves[n++] = {counts[symbol], symbol};
+        }
+    }
+    if (n == 1) {
+        lengths[leaves[0].second] = 1;
+    }
+    if (n <= 1) {
+        return lengths;
+    }
+    std::sort(leaves, leaves + n);
+    uint64_t weights[511];
+    for (size_t i = 0; i < n; ++i) {
+        weights[i] = leaves[i].first;
+    }
+    for (;;) {
+        // Nodes 0 to n-1 are the leaves, inner nodes follow in the order
+        // they are made. Both come out in ascending weight, so the two
+        // lightest nodes are always at the head of one or the other.
+        size_t parent[511];
+        size_t leaf = 0;
+        size_t inner = n;
+        // The lightest node of those made before node `next`.
+        auto take = [&](size_t next) {
+            if (leaf < n && (inner == next || weights[leaf] <= weights[inner])) {
+                return leaf++;
+            }
+            return inner++;
+        };
+        for (size_t next = n; next < 2 * n - 1; ++next) {
+            size_t a = take(next);
+            size_t b = take(next);
+            weights[next] = weights[a] + weights[b];
+            parent[a] = next;
+            parent[b] = next;
+        }
+        // A parent comes after its children, so depths go root down.
+        unsigned depth[511];
+        depth[2 * n - 2] = 0;
+        unsigned longest = 0;
+        for (size_t node = 2 * n - 2; node-- > 0;) {
+            depth[node] = depth[parent[node]] + 1;
+            longest = std::max(longest, depth[node]);
+        }
+        if (longest <= HUFFMAN_MAX_CODE_LENGTH) {
+            for (size_t i = 0; i < n; ++i) {
+                lengths[leaves[i].second] = static_cast<uint8_t>(depth[i]);
+            }
+            return lengths;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            weights[i] = (weights[i] + 1) / 2;
+        }
+    }
+}
+
+// Canonical codes for the lengths, bit-reversed: codes are written and read
+// starting from the low bit.
+inline std::array<uint16_t, 256> huffman_codes(const HuffmanLengths& lengths) {
+    unsigned length_count[HUFFMAN_MAX_CODE_LENGTH + 1] = {};
+    for (uint8_t length : lengths) {
+        ++length_count[length];
+    }
+    length_count[0] = 0;
+    unsigned next[HUFFMAN_MAX_CODE_LENGTH + 1] = {};
+    unsigned code = 0;
+    for (unsigned length = 1; length <= HUFFMAN_MAX_CODE_LENGTH; ++length) {
+        code = (code + length_count[length - 1]) << 1;
+        next[length] = code;
+    }
+    std::array<uint16_t, 256> codes{};
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        unsigned length = lengths[symbol];
+        if (length == 0) {
+            continue;
+        }
+        unsigned canonical = next[length]++;
+        unsigned reversed = 0;
+        for (unsigned bit = 0; bit < length; ++bit) {
+            reversed |= ((canonical >> bit) & 1) << (length - 1 - bit);
+        }
+        codes[symbol] = static_cast<uint16_t>(reversed);
+    }
+    return codes;
+}
+
+// Bits an ideal code needs for `total` bytes with these counts.
+inline double entropy_bits(const std::array<uint64_t, 256>& counts,
+                           uint64_t total) {
+    double bits = 0;
+    for (uint64_t count : counts) {
+        if (count > 0) {
+            bits -= count * std::log2(static_cast<double>(count) / total);
+        }
+    }
+    return bits;
+}
+
+// Appends one block: the varint sizes of the bytes and of their code, then
+// the code lengths and the packed codes. When coding would not save enough,
+// the code size equals the byte count and the bytes follow as is. The
+// entropy of the counts bounds the code from below, so blocks of nearly
+// random bytes are stored without building a code at all, and usually
+// without counting more than a sample of them.
+inline void entropy_encode_block(const unsigned char* data, size_t size,
+                                 std::vector<unsigned char>& out) {
+    size_t limit = size - size / HUFFMAN_MIN_SAVING;
+    std::array<uint64_t, 256> sample{};
+    uint64_t sampled = 0;
+    for (size_t i = 0; i < size; i += HUFFMAN_SAMPLE_STRIDE, ++sampled) {
+        ++sample[data[i]];
+    }
+    if (sampled == 0 || entropy_bits(sample, sampled) * size / sampled / 8 +
+                                        HUFFMAN_LENGTHS_SIZE >= limit) {
+        put_varint(out, size);
+        put_varint(out, size);
+        out.insert(out.end(), data, data + size);
+        return;
+    }
+    // Four tables, so runs of one byte value do not serialize on a counter.
+    uint32_t partial[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        ++partial[0][data[i]];
+        ++partial[1][data[i + 1]];
+        ++partial[2][data[i + 2]];
+        ++partial[3][data[i + 3]];
+    }
+    for (; i < size; ++i) {
+        ++partial[0][data[i]];
+    }
+    std::array<uint64_t, 256> counts{};
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        counts[symbol] = uint64_t(partial[0][symbol]) + partial[1][symbol] +
+                         partial[2][symbol] + partial[3][symbol];
+    }
+    size_t coded = size;
+    HuffmanLengths lengths{};
+    if (entropy_bits(counts, size) / 8 + HUFFMAN_LENGTHS_SIZE < limit) {
+        lengths = huffman_lengths(counts);
+        uint64_t bits = 0;
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            bits += counts[symbol] * lengths[symbol];
+        }
+        coded = static_cast<size_t>((bits + 7) / 8);
+    }
+    put_varint(out, size);
+    if (coded + HUFFMAN_LENGTHS_SIZE >= limit) {
+        put_varint(out, size);
+        out.insert(out.end(), data, data + size);
+        return;
+    }
+    put_varint(out, coded);
+    for (size_t i = 0; i < HUFFMAN_LENGTHS_SIZE; ++i) {
+        out.push_back(static_cast<unsigned char>(lengths[2 * i] | lengths[2 * i + 1] << 4));
+    }
+    // Code in the low half, length in the high half.
+    std::array<uint16_t, 256> codes = huffman_codes(lengths);
+    uint32_t symbols[256];
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        symbols[symbol] = codes[symbol] | static_cast<uint32_t>(lengths[symbol]) << 16;
+    }
+    // Codes go out 32 bits at a time, checked every two codes; the buffer
+    // never holds more than 31 + 2 * HUFFMAN_MAX_CODE_LENGTH bits. Room for
+    // a last partial word.
+    size_t start = out.size();
+    out.resize(start + coded + 4);
+    unsigned char* p = out.data() + start;
+    uint64_t buffer = 0;
+    unsigned filled = 0;
+    auto put = [&](unsigned char byte) {
+        uint32_t symbol = symbols[byte];
+        buffer |= static_cast<uint64_t>(symbol & 0xffff) << filled;
+        filled += symbol >> 16;
+    };
+    auto flush = [&] {
+        if (filled >= 32) {
+            uint32_t word = static_cast<uint32_t>(buffer);
+            std::memcpy(p, &word, 4);
+            p += 4;
+            buffer >>= 32;
+            filled -= 32;
+        }
+    };
+    i = 0;
+    for (; i + 2 <= size; i += 2) {
+        put(data[i]);
+        put(data[i + 1]);
+        flush();
+    }
+    if (i < size) {
+        put(data[i]);
+        flush();
+    }
+    uint32_t word = static_cast<uint32_t>(buffer);
+    std::memcpy(p, &word, 4);
+    out.resize(start + coded);
+}
+
+// Decodes `size` bytes from a Huffman block body (code lengths, then codes)
+// into out. The body must be followed by 8 readable bytes.
+inline void entropy_decode_block(const unsigned char* body, size_t size,
+                                 unsigned char* out, HuffmanTable& table) {
+    HuffmanLengths lengths;
+    for (size_t i = 0; i < HUFFMAN_LENGTHS_SIZE; ++i) {
+        lengths[2 * i] = body[i] & 0x0f;
+        lengths[2 * i + 1] = body[i] >> 4;
+    }
+    // Every entry whose low bits are a symbol's code decodes to the symbol.
+    table.fill(0);
+    std::array<uint16_t, 256> codes = huffman_codes(lengths);
+    for (int symbol = 0; symbol < 256; ++symbol) {
+        unsigned length = lengths[symbol];
+        if (length == 0 || length > HUFFMAN_MAX_CODE_LENGTH) {
+            continue;
+        }
+        for (size_t index = codes[symbol]; index < table.size(); index += size_t(1) << length) {
+            table[index] = static_cast<uint16_t>(symbol | length << 8);
+        }
+    }
+    // Each refill loads eight bytes and keeps at least 56 bits, enough for
+    // five codes.
+    const unsigned char* p = body + HUFFMAN_LENGTHS_SIZE;
+    const size_t mask = table.size() - 1;
+    uint64_t buffer = 0;
+    unsigned filled = 0;
+    size_t i = 0;
+    auto refill = [&] {
+        uint64_t word;
+        std::memcpy(&word, p, 8);
+        buffer |= word << filled;
+        p += (63 - filled) >> 3;
+        filled |= 56;
+    };
+    auto next = [&] {
+        uint16_t entry = table[buffer & mask];
+        out[i++] = static_cast<unsigned char>(entry);
+        buffer >>= entry >> 8;
+        filled -= entry >> 8;
+    };
+    for (; i + 5 <= size;) {
+        refill();
+        next();
+        next();
+        next();
+        next();
+        next();
+    }
+    while (i < size) {
+        refill();
+        next();
+    }
+}
+
+// Encodes elements one at a time into a byte stream and decodes them back in
+// the same order. decode() consumes nothing and returns false when [p, end)
+// does not hold the whole next element.
+template <typename T, bool Integral = std::is_integral<T>::value>
+class ElementCodec;
+
+template <typename T>
+class ElementCodec<T, true> {
+public:
+    void encode(const T& value, std::vector<unsigned char>& out) {
+        uint64_t u = to_unsigned(value);
+        if (count_ > 0 && u == current_) {
+            ++count_;
+            return;
+        }
+        finish(out);
+        current_ = u;
+        count_ = 1;
+    }
+
+    // Writes the group still being counted.
+    void finish(std::vector<unsigned char>& out) {
+        if (count_ == 0) {
+            return;
+        }
+        // First byte: repeat flag in bit 0, low six bits of the step above
+        // it, then a plain varint for the rest of the step. The step is
+        // taken modulo 2^64, so unsorted input still round-trips.
+        uint64_t step = current_ - previous_;
+        bool repeated = count_ > 1;
+        unsigned char first = static_cast<unsigned char>(
+                (repeated ? 1 : 0) | ((step & 0x3f) << 1));
+        step >>= 6;
+        out.push_back(static_cast<unsigned char>(first | (step != 0 ? 0x80 : 0)));
+        if (step != 0) {
+            put_varint(out, step);
+        }
+        if (repeated) {
+            put_varint(out, count_ - 2);
+        }
+        previous_ = current_;
+        count_ = 0;
+    }
+
+    bool decode(const unsigned char*& p, const unsigned char* end, T& value) {
+        if (count_ == 0) {
+            const unsigned char* q = p;
+            if (q == end) {
+                return false;
+            }
+            unsigned char first = *q++;
+            uint64_t step = (first >> 1) & 0x3f;
+            if ((first & 0x80) != 0 && !get_varint_tail(q, end, step, 6)) {
+                return false;
+            }
+            uint64_t count = 1;
+            if ((first & 1) != 0) {
+                if (!get_varint(q, end, count)) {
+                    return false;
+                }
+                count += 2;
+            }
+            p = q;
+            current_ = previous_ + step;
+            previous_ = current_;
+            count_ = count;
+        }
+        --count_;
+        value = from_unsigned(current_);
+        return true;
+    }
+
+private:
+    using Unsigned = typename std::make_unsigned<T>::type;
+    static constexpr uint64_t SIGN_BIT =
+            std::is_signed<T>::value ? uint64_t(1) << (8 * sizeof(T) - 1) : 0;
+
+    static uint64_t to_unsigned(T value) {
+        return static_cast<uint64_t>(static_cast<Unsigned>(value)) ^ SIGN_BIT;
+    }
+
+    static T from_unsigned(uint64_t value) {
+        return static_cast<T>(static_cast<Unsigned>(value ^ SIGN_BIT));
+    }
+
+    uint64_t previous_ = 0;
+    uint64_t current_ = 0;
+    uint64_t count_ = 0;  // elements of the current group not yet written/read
+};
+
+template <typename T>
+class ElementCodec<T, false> {
+public:
+    void encode(const T& value, std::vector<unsigned char>& out) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        size_t shared = 0;
+        while (shared < sizeof(T) && bytes[shared] == previous_[shared]) {
+            ++shared;
+        }
+        put_varint(out, shared);
+        out.insert(out.end(), bytes + shared, bytes + sizeof(T));
+        std::memcpy(previous_, bytes, sizeof(T));
+    }
+
+    void finish(std::vector<unsigned char>&) {}
+
+    bool decode(const unsigned char*& p, const unsigned char* end, T& value) {
+        const unsigned char* q = p;
+        uint64_t shared;
+        if (!get_varint(q, end, shared) || shared > sizeof(T) ||
+            static_cast<size_t>(end - q) < sizeof(T) - shared) {
+            return false;
+        }
+        std::memcpy(previous_ + shared, q, sizeof(T) - shared);
+        p = q + (sizeof(T) - shared);
+        std::memcpy(&value, previous_, sizeof(T));
+        return true;
+    }
+
+private:
+    unsigned char previous_[sizeof(T)] = {};
+};
+
+// Encoded run writer. Elements are collected in a buffer of buffer_size bytes
+// and encoded a buffer at a time, so the codec cost is measured per batch
+// rather than per element. Full blocks of varint bytes are entropy-coded and
+// written as they fill; the rest waits for the next buffer.
+template <typename T>
+class CompressedRunWriter {
+public:
+    CompressedRunWriter(const std::string& filename, size_t buffer_size)
+            : file_(filename, std::ios::binary) {
+        if (!file_.is_open()) {
+            std::cerr << "Error opening run file for writing: " << filename
+                      << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        buffer_.reserve(std::max<size_t>(1, buffer_size / sizeof(T)));
+    }
+
+    ~CompressedRunWriter() {
+        if (!file_.is_open()) {
+            return;
+        }
+        encode_buffer();
+        codec_.finish(encoded_);
+        if (!encoded_.empty()) {
+            write_block(encoded_.data(), encoded_.size());
+        }
+        RunCodecStats& stats = run_codec_stats();
+        ++stats.runs;
+        stats.raw_bytes += raw_bytes_;
+        stats.encoded_bytes += encoded_bytes_;
+        stats.encode_ns += encode_ns_;
+    }
+
+    CompressedRunWriter(CompressedRunWriter&&) = default;
+
+    void put(const T& value) {
+        buffer_.push_back(value);
+        if (buffer_.size() == buffer_.capacity()) {
+            encode_buffer();
+        }
+    }
+
+    void write(const T* data, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            put(data[i]);
+        }
+    }
+
+private:
+    void encode_buffer() {
+        auto start = std::chrono::steady_clock::now();
+        for (const T& value : buffer_) {
+            codec_.encode(value, encoded_);
+        }
+        encode_ns_ += elapsed_ns(start);
+        raw_bytes_ += buffer_.size() * sizeof(T);
+        buffer_.clear();
+
+        size_t offset = 0;
+        for (; encoded_.size() - offset >= RUN_CODEC_BLOCK_SIZE;
+             offset += RUN_CODEC_BLOCK_SIZE) {
+            write_block(encoded_.data() + offset, RUN_CODEC_BLOCK_SIZE);
+        }
+        encoded_.erase(encoded_.begin(), encoded_.begin() + offset);
+    }
+
+    void write_block(const unsigned char* data, size_t size) {
+        auto start = std::chrono::steady_clock::now();
+        block_.clear();
+        entropy_encode_block(data, size, block_);
+        encode_ns_ += elapsed_ns(start);
+        file_.write(reinterpret_cast<const char*>(block_.data()), block_.size());
+        encoded_bytes_ += block_.size();
+    }
+
+    std::ofstream file_;
+    std::vector<T> buffer_;
+    std::vector<unsigned char> encoded_;
+    std::vector<unsigned char> block_;
+    ElementCodec<T> codec_;
+    uint64_t raw_bytes_ = 0;
+    uint64_t encoded_bytes_ = 0;
+    uint64_t encode_ns_ = 0;
+};
+
+// Streaming decoder over one encoded run. Half of buffer_size holds the
+// decoded batch the merge is reading from; the varint bytes are read one
+// entropy-coded block at a time.
+template <typename T>
+class CompressedRunReader {
+public:
+    CompressedRunReader(const std::string& filename, size_t buffer_size)
+            : file_(filename, std::ios::binary),
+              encoded_(RUN_CODEC_BLOCK_SIZE + 2 * max_encoded_size()),
+              block_(encoded_.size() + 8),
+              decoded_(std::max<size_t>(1, buffer_size / 2 / sizeof(T))) {
+        if (!file_.is_open()) {
+            std::cerr << "Error opening run file for reading: " << filename
+                      << std::endl;
+            throw std::runtime_error("Error opening file");
+        }
+        decode_batch();
+    }
+
+    bool exhausted() const { return pos_ == end_; }
+
+    const T& head() const { return decoded_[pos_]; }
+
+    void advance() {
+        if (++pos_ == end_) {
+            decode_batch();
+        }
+    }
+
+private:
+    // Upper bound on the bytes of one encoded element.
+    static constexpr size_t max_encoded_size() {
+        return std::is_integral<T>::value ? 32 : sizeof(T) + 10;
+    }
+
+    // Reads a varint of a block header. False at the end of the run.
+    bool read_size(uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            int byte = file_.get();
+            if (byte == std::char_traits<char>::eof()) {
+                if (shift != 0) {
+                    throw std::runtime_error("Run file ends inside a block header");
+                }
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0 || shift > 56) {
+                return true;
+            }
+        }
+    }
+
+    // Moves the undecoded tail to the front and appends the next block.
+    bool refill() {
+        std::memmove(encoded_.data(), encoded_.data() + in_pos_, in_end_ - in_pos_);
+        in_end_ -= in_pos_;
+        in_pos_ = 0;
+        uint64_t size;
+        uint64_t coded;
+        if (!read_size(size)) {
+            return false;
+        }
+        if (!read_size(coded) || size > encoded_.size() - in_end_ ||
+            (coded != size && coded + HUFFMAN_LENGTHS_SIZE >= size)) {
+            throw std::runtime_error("Corrupt run file block");
+        }
+        unsigned char* out = encoded_.data() + in_end_;
+        size_t body = coded == size ? size : HUFFMAN_LENGTHS_SIZE + coded;
+        unsigned char* target = coded == size ? out : block_.data();
+        if (!file_.read(reinterpret_cast<char*>(target), body)) {
+            throw std::runtime_error("Run file ends inside a block");
+        }
+        if (coded != size) {
+            std::memset(block_.data() + body, 0, 8);
+            entropy_decode_block(block_.data(), size, out, table_);
+        }
+        in_end_ += size;
+        return true;
+    }
+
+    void decode_batch() {
+        auto start = std::chrono::steady_clock::now();
+        pos_ = 0;
+        end_ = 0;
+        while (end_ < decoded_.size()) {
+            const unsigned char* p = encoded_.data() + in_pos_;
+            const unsigned char* limit = encoded_.data() + in_end_;
+            while (end_ < decoded_.size() && codec_.decode(p, limit, decoded_[end_])) {
+                ++end_;
+            }
+            in_pos_ = static_cast<size_t>(p - encoded_.data());
+            if (end_ < decoded_.size() && !refill()) {
+                if (in_pos_ != in_end_) {
+                    throw std::runtime_error("Run file ends inside an element");
+                }
+                break;
+            }
+        }
+        run_codec_stats().decode_ns += elapsed_ns(start);
+    }
+
+    std::ifstream file_;
+    std::vector<unsigned char> encoded_;
+    std::vector<unsigned char> block_;
+    HuffmanTable table_;
+    std::vector<T> decoded_;
+    ElementCodec<T> codec_;
+    size_t in_pos_ = 0;
+    size_t in_end_ = 0;
+    size_t pos_ = 0;
+    size_t end_ = 0;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Approximate set structures for dedup, fed with the 64-bit line hashes
+// from hash_line. Both use a fixed amount of memory however many lines
+// they see.
+
+const unsigned HLL_DEFAULT_PRECISION = 14;
+const unsigned HLL_MIN_PRECISION = 4;
+const unsigned HLL_MAX_PRECISION = 18;
+
+// HyperLogLog distinct counter with 2^precision one-byte registers. The
+// standard error is about 1.04 / sqrt(2^precision), 0.8% at the default.
+// Sketches with the same precision merge by taking register maxima, so
+// every thread can count its own range.
+class HyperLogLog {
+public:
+    explicit HyperLogLog(unsigned precision = HLL_DEFAULT_PRECISION)
+            : precision_(std::clamp(precision, HLL_MIN_PRECISION, HLL_MAX_PRECISION)),
+              registers_(size_t(1) << precision_) {}
+
+    void add(uint64_t hash) {
+        size_t index = static_cast<size_t>(hash >> (64 - precision_));
+        // The guard bit caps the rank when the remaining bits are all zero.
+        uint64_t rest = (hash << precision_) | (uint64_t(1) << (precision_ - 1));
+        uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        registers_[index] = std::max(registers_[index], rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (size_t i = 0; i < registers_.size(); ++i) {
+            registers_[i] = std::max(registers_[i], other.registers_[i]);
+        }
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(registers_.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t rank : registers_) {
+            sum += std::ldexp(1.0, -rank);
+            zeros += rank == 0;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double raw = alpha * m * m / sum;
+        // Small cardinalities: linear counting over the empty registers.
+        if (raw <= 2.5 * m && zeros > 0) {
+            return m * std::log(m / zeros);
+        }
+        return raw;
+    }
+
+    double standard_error() const {
+        return 1.04 / std::sqrt(static_cast<double>(registers_.size()));
+    }
+
+    unsigned precision() const { return precision_; }
+
+private:
+    unsigned precision_;
+    std::vector<uint8_t> registers_;
+};
+
+// Bloom filter sized for `capacity` items at false-positive rate
+// `fp_rate`. The k bit positions come from the two halves of the line hash
+// (double hashing), so a line is hashed only once.
+class BloomFilter {
+public:
+    BloomFilter(size_t capacity, double fp_rate) {
+        fp_rate = std::clamp(fp_rate, 1e-9, 0.5);
+        double ln2 = std::log(2.0);
+        double bits = -static_cast<double>(std::max<size_t>(1, capacity)) *
+                      std::log(fp_rate) / (ln2 * ln2);
+        bits_ = std::max<uint64_t>(64, static_cast<uint64_t>(std::ceil(bits)));
+        hashes_ = std::max(1u, static_cast<unsigned>(std::lround(-std::log2(fp_rate))));
+        words_.assign((bits_ + 63) / 64, 0);
+    }
+
+    // Sets the line's bits. Returns true if any was clear, i.e. the line
+    // was certainly not added before.
+    bool add(uint64_t hash) {
+        uint64_t h1 = hash;
+        uint64_t h2 = (hash >> 32 | hash << 32) | 1;
+        bool added = false;
+        for (unsigned i = 0; i < hashes_; ++i) {
+            uint64_t bit = (h1 + i * h2) % bits_;
+            uint64_t mask = uint64_t(1) << (bit % 64);
+            uint64_t& word = words_[bit / 64];
+            added |= (word & mask) == 0;
+            word |= mask;
+        }
+        return added;
+    }
+
+    size_t bytes() const { return words_.size() * sizeof(uint64_t); }
+
+    unsigned hashes() const { return hashes_; }
+
+private:
+    uint64_t bits_;
+    unsigned hashes_;
+    std::vector<uint64_t> words_;
+};
@@ -1,6 +1,7 @@
 #include <cassert>
 #include <filesystem>
 #include <iostream>
+#include <set>
 #include <string>
 
 #include "test_utils.h"
@@ -80,9 +81,176 @@ void testDedupManyDuplicates() {
     std::cout << "Dedup with many duplicates test passed." << std::endl;
 }
 
+void testDedupParallelDeterministic() {
+    std::cout << "Running parallel dedup test..." << std::endl;
+    std::string inputFile = "dedup_parallel_input.txt";
+    std::string singleOutput = "dedup_parallel_single.txt";
+    std::string parallelOutput = "dedup_parallel_output.txt";
+    std::ofstream file(inputFile);
+    for (int i = 0; i < 20000; ++i) {
+        file << "line-" << (i * 7919) % 5000 << "\n";
+    }
+    file << "no-newline";
+    file.close();
+
+    executeCommand("./dedup 1 --input=" + inputFile + " --output=" + singleOutput +
+                   " --threads=1");
+    std::string output = executeCommand("./dedup 1 --input=" + inputFile +
+                                        " --output=" + parallelOutput +
+                                        " --threads=4");
+    assert(output.find("Deduped 20001 lines (5001 unique)") != std::string::npos);
+    // Thread count changes how the input is split, never the output.
+    assert(compareFiles(singleOutput, parallelOutput));
+
+    // Scanning the mapped input must find the same lines as streaming it.
+    output = executeCommand("./dedup 1 --input=" + inputFile + " --output=" +
+                            parallelOutput + " --threads=4 --mmap");
+    assert(output.find("Deduped 20001 lines (5001 unique)") != std::string::npos);
+    assert(compareFiles(singleOutput, parallelOutput));
+
+    // --ordered writes first occurrences in input order.
+    executeCommand("./dedup 1 --input=" + inputFile + " --output=" + parallelOutput +
+                   " --threads=4 --ordered");
+    std::ifstream ordered(parallelOutput);
+    std::string line;
+    for (int i = 0; i < 5000; ++i) {
+        std::getline(ordered, line);
+        assert(line == "line-" + std::to_string((i * 7919) % 5000));
+    }
+    assert(std::getline(ordered, line) && line == "no-newline");
+    assert(!std::getline(ordered, line));
+
+    fs::remove(inputFile);
+    fs::remove(singleOutput);
+    fs::remove(parallelOutput);
+    std::cout << "Parallel dedup test passed." << std::endl;
+}
+
+void testDedupSpill() {
+    std::cout << "Running spilling dedup test..." << std::endl;
+    std::string inputFile = "dedup_spill_input.txt";
+    std::string singleOutput = "dedup_spill_single.txt";
+    std::string parallelOutput = "dedup_spill_output.txt";
+    std::ofstream file(inputFile);
+    for (int i = 0; i < 60000; ++i) {
+        file << "spilled-line-" << (i * 7919) % 40000 << "\n";
+    }
+    file.close();
+
+    // About 2 MB of lines plus per-line overhead do not fit in 1 MB.
+    std::string output = executeCommand("./dedup 1 --input=" + inputFile +
+                                        " --output=" + singleOutput +
+                                        " --threads=1 --mem-limit=1");
+    assert(output.find("Deduped 60000 lines (40000 unique)") != std::string::npos);
+    assert(output.find("partitions") != std::string::npos);
+    executeCommand("./dedup 1 --input=" + inputFile + " --output=" + parallelOutput +
+                   " --threads=4 --mem-limit=1");
+    assert(compareFiles(singleOutput, parallelOutput));
+    assert(!fs::exists("temp_dedup_0_0.tmp"));
+
+    fs::remove(inputFile);
+    fs::remove(singleOutput);
+    fs::remove(parallelOutput);
+    std::cout << "Spilling dedup test passed." << std::endl;
+}
+
+void testDedupApproximate() {
+    std::cout << "Running approximate dedup test..." << std::endl;
+    std::string inputFile = "dedup_approx_input.txt";
+    std::string outputFile = "dedup_approx_output.txt";
+    std::ofstream file(inputFile);
+    for (int i = 0; i < 50000; ++i) {
+        file << "approx-" << (i * 7919) % 20000 << "\n";
+    }
+    file.close();
+
+    std::string output = executeCommand("./dedup 1 --input=" + inputFile +
+                                        " --count-distinct --threads=4");
+    size_t at = output.find("Counted ~");
+    assert(at != std::string::npos);
+    long distinct = std::stol(output.substr(at + 9));
+    assert(distinct > 19000 && distinct < 21000);
+
+    // A Bloom filter never passes a repeat, and drops few new lines.
+    output = executeCommand("./dedup 1 --input=" + inputFile +
+                            " --output=" + outputFile + " --bloom=0.01");
+    assert(output.find("Filtered 50000 lines") != std::string::npos);
+    std::ifstream result(outputFile);
+    std::set<std::string> seen;
+    std::string line;
+    while (std::getline(result, line)) {
+        assert(seen.insert(line).second);
+    }
+    assert(seen.size() <= 20000 && seen.size() > 19800);
+
+    fs::remove(inputFile);
+    fs::remove(outputFile);
+    std::cout << "Approximate dedup test passed." << std::endl;
+}
+
+void testDedupIndex() {
+    std::cout << "Running incremental dedup test..." << std::endl;
+    std::string firstInput = "dedup_index_first.txt";
+    std::string secondInput = "dedup_index_second.txt";
+    std::string outputFile = "dedup_index_output.txt";
+    std::string indexFile = "dedup_index.idx";
+    std::ofstream first(firstInput);
+    for (int i = 0; i < 3000; ++i) {
+        first << "segment-" << i % 2000 << "\n";
+    }
+    first.close();
+    std::ofstream second(secondInput);
+    for (int i = 1500; i < 2500; ++i) {
+        second << "segment-" << i << "\n";
+    }
+    second.close();
+
+    std::string output = executeCommand("./dedup 1 --input=" + firstInput + " --output=" +
+                                        outputFile + " --index=" + indexFile);
+    assert(output.find("Deduped 3000 lines (2000 new, index 2000)") != std::string::npos);
+    // Every run writes its batch into the table and empties the log.
+    assert(fs::file_size(indexFile + ".log") == 0);
+    // The second run only writes lines the first one has not seen.
+    output = executeCommand("./dedup 1 --input=" + secondInput + " --output=" +
+                            outputFile + " --index=" + indexFile);
+    assert(output.find("Deduped 1000 lines (500 new, index 2500)") != std::string::npos);
+    assert(fs::file_size(indexFile + ".log") == 0);
+    std::ifstream result(outputFile);
+    std::string line;
+    for (int i = 2000; i < 2500; ++i) {
+        std::getline(result, line);
+        assert(line == "segment-" + std::to_string(i));
+    }
+    assert(!std::getline(result, line));
+
+    fs::remove(firstInput);
+    fs::remove(secondInput);
+    fs::remove(outputFile);
+    fs::remove(indexFile);
+    fs::remove(indexFile + ".log");
+    std::cout << "Incremental dedup test passed." << std::endl;
+}
+
+void testDedupBenchSmall() {
+    std::cout << "Running dedup-bench test..." << std::endl;
+    // The bench checks that every container finds the same unique lines.
+    std::string output = executeCommand(
+            "./dedup-bench --sizes=1000,20000 --unique=25 --iterations=1 2>&1");
+    assert(output.find("FlatLineSet (presized)") != std::string::npos);
+    assert(output.find("unique 250\n") != std::string::npos);
+    assert(output.find("unique 5000\n") != std::string::npos);
+    assert(output.find("differ") == std::string::npos);
+    std::cout << "dedup-bench test passed." << std::endl;
+}
+
 int main() {
     testDedupBasic();
     testDedupEmpty();
     testDedupManyDuplicates();
+    testDedupParallelDeterministic();
+    testDedupSpill();
+    testDedupApproximate();
+    testDedupIndex();
+    testDedupBenchSmall();
     return 0;
 }
\ No newline at end of file
@@ -1,40 +1,236 @@
 #include <cassert>
 #include <filesystem>
 
+#include "../input_gen.h"
 #include "test_utils.h"
 namespace fs = std::filesystem;
 
+template <typename T>
+std::vector<T> readElements(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+    std::vector<T> elements(bytes.size() / sizeof(T));
+    std::memcpy(elements.data(), bytes.data(), elements.size() * sizeof(T));
+    return elements;
+}
+
+// Whether outputFile holds exactly the elements ema-sort-int generates from
+// `seed`, in order. Unlike a sortedness check, this catches a sort that
+// drops or duplicates elements.
+template <typename T>
+bool isSortedInput(const std::string& outputFile, size_t size, uint64_t seed,
+                   Distribution distribution = Distribution::Uniform) {
+    std::string expectedFile = "test_expected.bin";
+    generate_input_file<T>(expectedFile, size, distribution, seed, 1);
+    std::vector<T> expected = readElements<T>(expectedFile);
+    fs::remove(expectedFile);
+    if constexpr (sizeof(T) == 1) {
+        // Counting sort: the large test has 256 MB of these.
+        std::vector<size_t> counts(256);
+        for (T value : expected) {
+            ++counts[static_cast<unsigned char>(value)];
+        }
+        size_t i = 0;
+        for (int value = CHAR_MIN; value <= CHAR_MAX; ++value) {
+            size_t count = counts[static_cast<unsigned char>(value)];
+            std::fill_n(expected.begin() + i, count, static_cast<T>(value));
+            i += count;
+        }
+    } else {
+        std::sort(expected.begin(), expected.end());
+    }
+    return readElements<T>(outputFile) == expected;
+}
+
 void testEmaSortIntSmall() {
     std::cout << "Running small ema-sort-int test..." << std::endl;
-    std::string inputFile = "test_input.bin";
     std::string outputFile = "test_output.bin";
     size_t fileSize = 1024 * 1024;
-    createRandomBinaryFile(inputFile, fileSize);
-    std::string command = "TEST=true ./ema-sort-int 1 1 1";
+    std::string command = "TEST=true ./ema-sort-int 1 1 1 --seed=1";
     executeCommand(command);
 
     assert(fs::file_size(outputFile) == fileSize);
-    fs::remove(inputFile);
+    assert(isSortedBinaryFile(outputFile));
+    assert(isSortedInput<char>(outputFile, fileSize, 1));
     fs::remove(outputFile);
     std::cout << "Small ema-sort-int test passed." << std::endl;
 }
 
 void testEmaSortIntLarge() {
     std::cout << "Running large ema-sort-int test..." << std::endl;
-    std::string inputFile = "test_large_input.bin";
     std::string outputFile = "test_output.bin";
     size_t fileSize = 256 * 1024 * 1024;
-    createRandomBinaryFile(inputFile, fileSize);
-    std::string command = "TEST=true ./ema-sort-int 1 256 10";
+    std::string command = "TEST=true ./ema-sort-int 1 256 10 --seed=1";
     executeCommand(command);
     assert(fs::file_size(outputFile) == fileSize);
-    fs::remove(inputFile);
+    assert(isSortedBinaryFile(outputFile));
+    assert(isSortedInput<char>(outputFile, fileSize, 1));
     fs::remove(outputFile);
     std::cout << "Large ema-sort-int test passed." << std::endl;
 }
 
+void testEmaSortIntHistogram() {
+    std::cout << "Running histogram ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 8 * 1024 * 1024;
+    std::string command =
+            "TEST=true ./ema-sort-int 1 8 1 --mode=histogram --threads=4"
+            " --seed=1";
+    executeCommand(command);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile(outputFile));
+    assert(isSortedInput<char>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Histogram ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntTyped() {
+    std::cout << "Running typed ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 4 * 1024 * 1024;
+    executeCommand("TEST=true ./ema-sort-int 1 4 1 --type=int64 --seed=1");
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int64_t>(outputFile));
+    assert(isSortedInput<int64_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Typed ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntThreaded() {
+    std::cout << "Running threaded ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 4 * 1024 * 1024;
+    executeCommand(
+            "TEST=true ./ema-sort-int 1 4 1 --type=int64 --threads=4 --seed=1");
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int64_t>(outputFile));
+    assert(isSortedInput<int64_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Threaded ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntMultiPassMerge() {
+    std::cout << "Running multi-pass merge ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 5 * 1024 * 1024;
+    std::string output = executeCommand(
+            "TEST=true ./ema-sort-int 1 5 1 --type=int32 --fan-in=2 --seed=1");
+    assert(output.find("Runs: 5, merge passes: 3, fan-in: 2") !=
+           std::string::npos);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int32_t>(outputFile));
+    assert(isSortedInput<int32_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Multi-pass merge ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntDirectIo() {
+    std::cout << "Running direct I/O ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 5 * 1024 * 1024;
+    std::string output = executeCommand(
+            "TEST=true ./ema-sort-int 1 5 1 --type=int32 --fan-in=2"
+            " --threads=2 --mem-limit=2 --io=direct --seed=1");
+    assert(output.find("fan-in: 2") != std::string::npos);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int32_t>(outputFile));
+    assert(isSortedInput<int32_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Direct I/O ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntReplacementSelection() {
+    std::cout << "Running replacement selection ema-sort-int test..."
+              << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 6 * 1024 * 1024;
+    std::string output = executeCommand(
+            "TEST=true ./ema-sort-int 1 6 1 --type=int32 --run-gen=replacement"
+            " --seed=1");
+    // Runs of about twice the memory budget on random input.
+    assert(output.find("Runs: 4,") != std::string::npos);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int32_t>(outputFile));
+    assert(isSortedInput<int32_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Replacement selection ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntSortedInput() {
+    std::cout << "Running sorted input ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 4 * 1024 * 1024;
+    std::string output = executeCommand(
+            "TEST=true ./ema-sort-int 1 4 1 --type=int64 --dist=sorted"
+            " --run-gen=replacement --seed=1");
+    // Sorted input never leaves the first replacement-selection run.
+    assert(output.find("Runs: 1, merge passes: 0") != std::string::npos);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int64_t>(outputFile));
+    assert(isSortedInput<int64_t>(outputFile, fileSize, 1, Distribution::Sorted));
+    fs::remove(outputFile);
+    std::cout << "Sorted input ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortIntCompressedRuns() {
+    std::cout << "Running compressed runs ema-sort-int test..." << std::endl;
+    std::string outputFile = "test_output.bin";
+    size_t fileSize = 4 * 1024 * 1024;
+    std::string output = executeCommand(
+            "TEST=true ./ema-sort-int 1 4 1 --type=int32 --codec=delta"
+            " --fan-in=2 --seed=1");
+    assert(output.find("Runs: 4, merge passes: 2") != std::string::npos);
+    assert(output.find("Spill codec: 6 runs") != std::string::npos);
+    assert(fs::file_size(outputFile) == fileSize);
+    assert(isSortedBinaryFile<int32_t>(outputFile));
+    assert(isSortedInput<int32_t>(outputFile, fileSize, 1));
+    fs::remove(outputFile);
+    std::cout << "Compressed runs ema-sort-int test passed." << std::endl;
+}
+
+void testEmaSortBenchJson() {
+    std::cout << "Running ema-sort-bench JSON test..." << std::endl;
+    std::string jsonFile = "bench.json";
+    std::string output = executeCommand(
+            "./ema-sort-bench --sizes=2 --chunks=1 --threads=1,2 --iterations=2"
+            " --type=int32 --seed=1 --json=" + jsonFile);
+    assert(output.find("size 2 MB, chunk 1 MB, threads 2") != std::string::npos);
+    std::ifstream json(jsonFile);
+    std::stringstream contents;
+    contents << json.rdbuf();
+    std::string text = contents.str();
+    assert(text.find("\"throughput_mb_s\"") != std::string::npos);
+    assert(text.find("\"spill\": {\"p50\"") != std::string::npos);
+    assert(!fs::exists("bench_input.bin") && !fs::exists("bench_output.bin"));
+    fs::remove(jsonFile);
+    std::cout << "ema-sort-bench JSON test passed." << std::endl;
+}
+
+void testEmaSortBenchJsonStdout() {
+    std::cout << "Running ema-sort-bench JSON to stdout test..." << std::endl;
+    // The table goes to stderr, so stdout holds nothing but the document.
+    std::string output = executeCommand(
+            "./ema-sort-bench --sizes=2 --chunks=1 --threads=1 --iterations=1"
+            " --type=int32 --seed=1 --json=- 2>/dev/null");
+    assert(output.rfind("{\n", 0) == 0);
+    assert(output.find("size 2 MB") == std::string::npos);
+    assert(output.find("\"throughput_mb_s\"") != std::string::npos);
+    std::cout << "ema-sort-bench JSON to stdout test passed." << std::endl;
+}
+
 int main() {
     testEmaSortIntSmall();
     testEmaSortIntLarge();
+    testEmaSortIntHistogram();
+    testEmaSortIntTyped();
+    testEmaSortIntThreaded();
+    testEmaSortIntMultiPassMerge();
+    testEmaSortIntDirectIo();
+    testEmaSortIntReplacementSelection();
+    testEmaSortIntSortedInput();
+    testEmaSortIntCompressedRuns();
+    testEmaSortBenchJson();
+    testEmaSortBenchJsonStdout();
     return 0;
 }
\ No newline at end of file
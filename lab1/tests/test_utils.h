@@ -1,10 +1,13 @@
 #pragma once
 
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <climits>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <random>
@@ -109,6 +112,19 @@ bool compareFiles(const std::string& file1, const std::string& file2) {
                       std::istreambuf_iterator<char>(f2));
 }
 
+template <typename T = char>
+bool isSortedBinaryFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+    std::vector<T> data(bytes.size() / sizeof(T));
+    std::memcpy(data.data(), bytes.data(), data.size() * sizeof(T));
+    return std::is_sorted(data.begin(), data.end());
+}
+
 void createRandomBinaryFile(const std::string& filename, size_t size) {
     std::ofstream file(filename, std::ios::binary);
     if (!file.is_open()) {
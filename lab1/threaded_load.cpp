@@ -8,6 +8,8 @@
 #include <unordered_set>
 #include <vector>
 
+#include "radix_sort.h"
+
 void emaSort(int num_iterations) {
     size_t array_size = 1000000;
 
@@ -20,8 +22,9 @@ void emaSort(int num_iterations) {
             data[j] = distrib(gen);
         }
 
+        // Half the cores sort, the other half is left to the dedup thread.
         auto start = std::chrono::high_resolution_clock::now();
-        std::sort(data.begin(), data.end());
+        radix_sort(data, std::max(1u, std::thread::hardware_concurrency() / 2));
         auto end = std::chrono::high_resolution_clock::now();
 
         std::chrono::duration<double> duration = end - start;
@@ -6,7 +6,12 @@
 #include <cstring>
 #include <cstdarg>
 #include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <stdexcept>
 #include <unordered_map>
+#include <sys/stat.h>
 #include "cache.hpp"
 
 
@@ -23,28 +28,151 @@ typedef off_t (*lseek_func)(int fd, off_t offset, int whence);
 typedef int (*fsync_func)(int fd);
 
 
-static BlockCache *g_cache = nullptr;
+typedef int (*dup_func)(int oldfd);
+
+typedef int (*dup2_func)(int oldfd, int newfd);
+
+typedef int (*dup3_func)(int oldfd, int newfd, int flags);
+
+typedef int (*fcntl_func)(int fd, int cmd, ...);
+
+
+// Set and cleared under g_cache_lock; the wrappers only load it.
+// cache_destroy() must not race with I/O through the cache.
+static std::atomic<BlockCache *> g_cache{nullptr};
+static std::mutex g_cache_lock;
 const size_t BLOCK_SIZE = 4096;
 
 
-BlockCache::BlockCache(size_t cache_size) : cache_size_(cache_size), aio_context_() {
+// The next definition of a libc function, past the ones in this library.
+template<typename F>
+static F originalFunction(const char *name) {
+    F func = (F) dlsym(RTLD_NEXT, name);
+    if (!func) {
+        std::cerr << "dlsym error: " << dlerror() << std::endl;
+    }
+    return func;
+}
+
+// A second descriptor of the file `st` describes, opened from path with
+// O_DIRECT for read-ahead. -1 if the file system refuses O_DIRECT or path
+// names another file by now.
+static file_descriptor_t openReadAheadFd(const std::string &path, const struct stat &st) {
+    static open_func original_open = originalFunction<open_func>("open");
+    static close_func original_close = originalFunction<close_func>("close");
+    file_descriptor_t fd = original_open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat direct_st;
+    if (fstat(fd, &direct_st) == -1 || direct_st.st_dev != st.st_dev ||
+        direct_st.st_ino != st.st_ino) {
+        original_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+BlockCache::Shard::Shard(char *slab, size_t blocks, const std::string &policy)
+        : slab(slab), blocks(blocks), policy(makeReplacementPolicy(policy, blocks)),
+          index(blocks) {
+    free_slots.reserve(blocks);
+    for (uint32_t slot = blocks; slot-- > 0;) {
+        this->blocks[slot] = CacheBlock{nullptr, 0, 0, false, false};
+        free_slots.push_back(slot);
+    }
+}
+
+char *BlockCache::Shard::data(uint32_t slot) const {
+    return slab + static_cast<size_t>(slot) * BLOCK_SIZE;
+}
+
+
+BlockCache::BlockCache(size_t cache_size, const std::string &policy)
+        : cache_size_(std::max<size_t>(cache_size, 1)), slab_(nullptr), shard_mask_(0),
+          aio_context_(),
+          readahead_max_window_(std::min(CACHE_READAHEAD_MAX_WINDOW, cache_size_ / 4)),
+          readaheads_(CACHE_READAHEAD_DEPTH) {
+    if (!makeReplacementPolicy(policy, 1)) {
+        std::cerr << "Unknown replacement policy: " << policy << std::endl;
+        throw std::invalid_argument("Unknown replacement policy");
+    }
+    // Anonymous memory is page aligned and only backed once touched.
+    void *slab = mmap(nullptr, cache_size_ * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        std::cerr << "Error allocating cache: " << strerror(errno) << std::endl;
+        throw std::bad_alloc();
+    }
+    slab_ = static_cast<char *>(slab);
+
+    size_t shards = 1;
+    while (shards * 2 <= CACHE_MAX_SHARDS && cache_size_ / (shards * 2) >= CACHE_MIN_SHARD_BLOCKS) {
+        shards *= 2;
+    }
+    shard_mask_ = shards - 1;
+    size_t first = 0;
+    for (size_t i = 0; i < shards; ++i) {
+        size_t blocks = cache_size_ / shards + (i < cache_size_ % shards ? 1 : 0);
+        shards_.push_back(std::make_unique<Shard>(slab_ + first * BLOCK_SIZE, blocks, policy));
+        first += blocks;
+    }
+
+    for (uint32_t request = CACHE_READAHEAD_DEPTH; request-- > 0;) {
+        free_readaheads_.push_back(request);
+    }
+    if (readahead_max_window_ > 0) {
+        int result = io_setup(CACHE_READAHEAD_DEPTH, &aio_context_);
+        if (result < 0) {
+            std::cerr << "Read-ahead disabled, io_setup: " << strerror(-result) << std::endl;
+            aio_context_ = io_context_t();
+        }
+    }
 }
 
 
 BlockCache::~BlockCache() {
+    if (aio_context_) {
+        // The kernel may still be writing into the slab.
+        std::unique_lock<std::mutex> aio_lock(aio_lock_);
+        while (free_readaheads_.size() < readaheads_.size()) {
+            awaitReadAhead(aio_lock);
+        }
+        io_destroy(aio_context_);
+    }
     flushAllDirtyBlocks();
+    // Without the cache, the kernel's offset applies again.
+    static lseek_func original_lseek = originalFunction<lseek_func>("lseek");
+    static close_func original_close = originalFunction<close_func>("close");
+    for (auto &stripe: file_stripes_) {
+        for (auto &entry: stripe.files) {
+            if (entry.second->readahead_fd != -1 && original_close) {
+                original_close(entry.second->readahead_fd);
+            }
+            entry.second->readahead_fd = -1;
+            if (original_lseek) {
+                original_lseek(entry.first, entry.second->offset, SEEK_SET);
+            }
+        }
+    }
+    munmap(slab_, cache_size_ * BLOCK_SIZE);
 }
 
 void BlockCache::flushAllDirtyBlocks() {
-    for (auto &block: cache_list_) {
-        if (block.dirty) {
-            flushBlock(block);
+    for (auto &shard: shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->lock);
+        for (uint32_t slot = 0; slot < shard->blocks.size(); ++slot) {
+            if (shard->blocks[slot].file && shard->blocks[slot].dirty) {
+                flushBlock(*shard, slot);
+            }
         }
     }
 }
 
-void BlockCache::flushBlock(CacheBlock &block) {
-    ssize_t bytesWritten = pwrite(block.fd, block.data.data(), block.data.size(), block.offset);
+void BlockCache::flushBlock(Shard &shard, uint32_t slot) {
+    CacheBlock &block = shard.blocks[slot];
+    ssize_t bytesWritten = pwrite(block.file->io_fd, shard.data(slot), block.size, block.offset);
 
     if (bytesWritten == -1) {
         std::cerr << "Error in pwrite: " << strerror(errno) << std::endl;
@@ -55,102 +183,328 @@ void BlockCache::flushBlock(CacheBlock &block) {
 
 
 file_descriptor_t BlockCache::openFile(const std::string &path, int flags, int mode) {
-    static open_func original_open = nullptr;
+    static open_func original_open = originalFunction<open_func>("open");
     if (!original_open) {
-        original_open = (open_func) dlsym(RTLD_NEXT, "open");
-        if (!original_open) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    return original_open(path.c_str(), flags & ~O_DIRECT, mode);
+    // Partial block writes read the rest of the block first, so write-only
+    // files are opened for reading too when permissions allow. O_APPEND
+    // stays on the fd: appends are written through (see appendThrough), so
+    // the cache never pwrite()s to such a file, which would append too.
+    int cache_flags = flags & ~O_DIRECT;
+    file_descriptor_t fd = -1;
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+        fd = original_open(path.c_str(), (cache_flags & ~O_ACCMODE) | O_RDWR, mode);
+    }
+    if (fd == -1) {
+        fd = original_open(path.c_str(), cache_flags, mode);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        // Only regular files are cached; pipes and devices pass through.
+        return fd;
+    }
+    auto file = std::make_shared<OpenFile>();
+    file->id = next_file_id_++;
+    file->io_fd = fd;
+    file->readahead_fd = -1;
+    if (aio_context_ && (flags & O_ACCMODE) != O_WRONLY) {
+        file->readahead_fd = openReadAheadFd(path, st);
+    }
+    file->fds.push_back(fd);
+    file->offset = 0;
+    file->size = st.st_size;
+    file->flags = flags;
+    file->last_block = -1;
+    file->closed = false;
+    file->readahead_expected = 0;
+    file->readahead_window = 0;
+    file->readahead_end = 0;
+    file->readahead_inflight = 0;
+    FileStripe &stripe = stripeOf(fd);
+    std::unique_lock<std::shared_mutex> stripe_lock(stripe.lock);
+    stripe.files[fd] = file;
+    return fd;
+}
+
+BlockCache::FileStripe &BlockCache::stripeOf(file_descriptor_t fd) const {
+    return file_stripes_[static_cast<size_t>(fd) % CACHE_FILE_STRIPES];
+}
+
+std::shared_ptr<BlockCache::OpenFile> BlockCache::findFile(file_descriptor_t fd) const {
+    FileStripe &stripe = stripeOf(fd);
+    std::shared_lock<std::shared_mutex> stripe_lock(stripe.lock);
+    auto it = stripe.files.find(fd);
+    return it == stripe.files.end() ? nullptr : it->second;
+}
+
+BlockCache::Shard &BlockCache::shardOf(const OpenFile *file, off_t offset) {
+    // The index buckets by the low bits of the same hash.
+    uint64_t hash = detail::pair_hash()(std::make_pair(file->id, offset));
+    return *shards_[(hash >> 32) & shard_mask_];
 }
 
 int BlockCache::closeFile(file_descriptor_t fd) {
-    flushDirtyBlocksForFd(fd);
-    for (auto it = cache_list_.begin(); it != cache_list_.end();) {
-        if (it->fd == fd) {
-            cache_map_.erase({fd, it->offset});
-            it = cache_list_.erase(it);
-        } else {
-            ++it;
+    std::shared_ptr<OpenFile> file;
+    {
+        FileStripe &stripe = stripeOf(fd);
+        std::unique_lock<std::shared_mutex> stripe_lock(stripe.lock);
+        auto entry = stripe.files.find(fd);
+        if (entry == stripe.files.end()) {
+            return 0;
         }
+        file = entry->second;
+        stripe.files.erase(entry);
     }
-    if (::close(fd) == -1) {
-        std::cerr << "Ошибка закрытия файла: " << fd << " - " << strerror(errno)
-                  << std::endl;
-        return -1;
+
+    std::lock_guard<std::mutex> file_lock(file->lock);
+    file->fds.erase(std::find(file->fds.begin(), file->fds.end(), fd));
+    if (!file->fds.empty()) {
+        // Other fds still share the file and its blocks.
+        if (file->io_fd == fd) {
+            file->io_fd = file->fds.front();
+            // An eviction in another thread may still be writing through
+            // fd; it holds its shard's lock until done, and fd must stay
+            // open until then.
+            for (auto &shard: shards_) {
+                std::unique_lock<std::shared_mutex> lock(shard->lock);
+            }
+        }
+        return 0;
+    }
+
+    // Blocks point at the file, so they must all be gone before the last
+    // reference to it is.
+    file->closed = true;
+    waitForReadAhead(file.get());
+    if (file->readahead_fd != -1) {
+        static close_func original_close = originalFunction<close_func>("close");
+        if (original_close) {
+            original_close(file->readahead_fd);
+        }
+        file->readahead_fd = -1;
+    }
+    for (auto &shard: shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->lock);
+        applyHits(*shard);
+        for (uint32_t slot = 0; slot < shard->blocks.size(); ++slot) {
+            if (shard->blocks[slot].file == file.get()) {
+                if (shard->blocks[slot].dirty) {
+                    flushBlock(*shard, slot);
+                }
+                dropBlock(*shard, slot);
+            }
+        }
     }
     return 0;
 }
 
+void BlockCache::duplicateFd(file_descriptor_t oldfd, file_descriptor_t newfd) {
+    std::shared_ptr<OpenFile> file = findFile(oldfd);
+    if (!file || oldfd == newfd) {
+        return;
+    }
+    closeFile(newfd);
+    {
+        std::lock_guard<std::mutex> file_lock(file->lock);
+        if (file->closed) {
+            return;
+        }
+        file->fds.push_back(newfd);
+    }
+    FileStripe &stripe = stripeOf(newfd);
+    std::unique_lock<std::shared_mutex> stripe_lock(stripe.lock);
+    stripe.files[newfd] = file;
+}
+
 ssize_t BlockCache::read(file_descriptor_t fd, void *buf, size_t count) {
-    off_t current_offset = lseek(fd, 0, SEEK_CUR);
-    if (current_offset == -1) {
-        std::cerr << "Error getting current offset: " << strerror(errno) << std::endl;
+    std::shared_ptr<OpenFile> file = findFile(fd);
+    if (!file) {
+        static read_func original_read = originalFunction<read_func>("read");
+        return original_read(fd, buf, count);
+    }
+    std::lock_guard<std::mutex> file_lock(file->lock);
+    if (file->closed || (file->flags & O_ACCMODE) == O_WRONLY) {
+        errno = EBADF;
         return -1;
     }
 
+    off_t current_offset = file->offset;
+    if (current_offset >= file->size) {
+        return 0;
+    }
+    off_t start_offset = current_offset;
+    count = std::min<size_t>(count, file->size - current_offset);
+
     size_t bytes_read = 0;
     while (bytes_read < count) {
         size_t block_offset = current_offset % BLOCK_SIZE;
         off_t block_start = current_offset - block_offset;
         size_t remaining_bytes = count - bytes_read;
         size_t read_size = std::min(remaining_bytes, BLOCK_SIZE - block_offset);
+        char *dest = static_cast<char *>(buf) + bytes_read;
 
-        CacheBlock *block = getBlock(fd, block_start);
-        if (!block) {
-            block = loadBlock(fd, block_start);
-            if (!block) {
-                return -1;
+        Shard &shard = shardOf(file.get(), block_start);
+        if (!readCached(shard, file.get(), block_start, block_offset, read_size, dest)) {
+            std::unique_lock<std::shared_mutex> lock(shard.lock);
+            uint32_t slot = residentBlock(shard, lock, file.get(), block_start);
+            if (slot == detail::NO_BLOCK) {
+                slot = loadBlock(shard, lock, file.get(), block_start);
+                if (slot == detail::NO_BLOCK) {
+                    return -1;
+                }
             }
-        }
 
-        std::memcpy(static_cast<char *>(buf) + bytes_read, block->data.data() + block_offset, read_size);
+            // The file may have grown past this block since it was loaded;
+            // the bytes in between were never written and read as zeros.
+            CacheBlock &block = shard.blocks[slot];
+            char *data = shard.data(slot);
+            if (block.size < block_offset + read_size) {
+                std::memset(data + block.size, 0, block_offset + read_size - block.size);
+                block.size = block_offset + read_size;
+            }
+            std::memcpy(dest, data + block_offset, read_size);
+        }
         bytes_read += read_size;
         current_offset += read_size;
     }
-    lseek(fd, current_offset, SEEK_SET);
+    file->offset = current_offset;
+    readAhead(file.get(), start_offset, current_offset);
     return bytes_read;
 }
 
-BlockCache::CacheBlock *BlockCache::getBlock(file_descriptor_t fd, file_offset_t offset) {
-    auto it = cache_map_.find({fd, offset});
-    if (it != cache_map_.end()) {
-        cache_list_.splice(cache_list_.begin(), cache_list_, it->second);
-        return &(*cache_list_.begin());
+bool BlockCache::readCached(Shard &shard, OpenFile *file, off_t block_start, size_t block_offset,
+                            size_t size, char *dest) {
+    std::shared_lock<std::shared_mutex> lock(shard.lock);
+    uint32_t slot = shard.index.find(file->id, block_start);
+    if (slot == detail::NO_BLOCK || shard.blocks[slot].loading ||
+        shard.blocks[slot].size < block_offset + size) {
+        return false;
+    }
+    std::memcpy(dest, shard.data(slot) + block_offset, size);
+    if (file->last_block != block_start) {
+        size_t hit = shard.hit_count.fetch_add(1, std::memory_order_relaxed);
+        if (hit < CACHE_HIT_BUFFER_SIZE) {
+            shard.hits[hit] = slot;
+        }
+        file->last_block = block_start;
     }
-    return nullptr;
+    return true;
 }
 
-BlockCache::CacheBlock *BlockCache::loadBlock(file_descriptor_t fd, file_offset_t offset) {
-    if (cache_list_.size() >= cache_size_) {
-        evictBlock();
+void BlockCache::applyHits(Shard &shard) {
+    size_t hits = std::min(shard.hit_count.load(std::memory_order_relaxed), CACHE_HIT_BUFFER_SIZE);
+    // Slots only change hands under the exclusive lock, which drains the
+    // buffer first, so every slot noted here still holds the block hit.
+    for (size_t i = 0; i < hits; ++i) {
+        shard.policy->access(shard.hits[i]);
     }
+    shard.hit_count.store(0, std::memory_order_relaxed);
+}
 
-    CacheBlock new_block = {fd, offset, std::vector<char>(BLOCK_SIZE), false};
+void BlockCache::dropBlock(Shard &shard, uint32_t slot) {
+    CacheBlock &block = shard.blocks[slot];
+    shard.index.erase(block.file->id, block.offset);
+    shard.policy->remove(slot);
+    block.file = nullptr;
+    block.dirty = false;
+    shard.free_slots.push_back(slot);
+}
 
-    ssize_t bytesRead = pread(fd, new_block.data.data(), BLOCK_SIZE, offset);
-    if (bytesRead == -1) {
-        std::cerr << "Error in pread: " << strerror(errno) << std::endl;
-        return nullptr;
+uint32_t BlockCache::getBlock(Shard &shard, OpenFile *file, file_offset_t offset) {
+    uint32_t slot = shard.index.find(file->id, offset);
+    if (slot == detail::NO_BLOCK || shard.blocks[slot].loading) {
+        return slot;
+    }
+    if (file->last_block != offset) {
+        shard.policy->access(slot);
+        file->last_block = offset;
     }
-    new_block.data.resize(bytesRead);
+    return slot;
+}
 
-    cache_list_.push_front(new_block);
-    auto it = cache_list_.begin();
-    cache_map_[{fd, offset}] = it;
-    return &(*it);
+uint32_t BlockCache::residentBlock(Shard &shard, std::unique_lock<std::shared_mutex> &lock,
+                                  OpenFile *file, file_offset_t offset) {
+    for (;;) {
+        applyHits(shard);
+        uint32_t slot = getBlock(shard, file, offset);
+        if (slot == detail::NO_BLOCK || !shard.blocks[slot].loading) {
+            return slot;
+        }
+        lock.unlock();
+        waitForBlock(shard, slot);
+        lock.lock();
+    }
+}
+
+uint32_t BlockCache::loadBlock(Shard &shard, std::unique_lock<std::shared_mutex> &lock,
+                               OpenFile *file, file_offset_t offset, bool fill) {
+    while (shard.free_slots.empty()) {
+        evictBlock(shard);
+        if (shard.free_slots.empty()) {
+            // Every slot of the shard is being loaded. The file stays
+            // locked, so nobody else adds its block at offset meanwhile.
+            lock.unlock();
+            waitForAnyReadAhead();
+            lock.lock();
+            applyHits(shard);
+        }
+    }
+    uint32_t slot = shard.free_slots.back();
+    shard.free_slots.pop_back();
+    char *data = shard.data(slot);
+
+    ssize_t bytesRead = 0;
+    if (fill) {
+        bytesRead = pread(file->io_fd, data, BLOCK_SIZE, offset);
+        if (bytesRead == -1) {
+            std::cerr << "Error in pread: " << strerror(errno) << std::endl;
+            shard.free_slots.push_back(slot);
+            return detail::NO_BLOCK;
+        }
+    }
+    // Bytes written past the end of the file on disk but not flushed yet
+    // read as zeros, like a hole.
+    off_t cached_end = std::max<off_t>(std::min<off_t>(file->size - offset, BLOCK_SIZE), 0);
+    if (cached_end > bytesRead) {
+        std::memset(data + bytesRead, 0, cached_end - bytesRead);
+    }
+
+    CacheBlock &block = shard.blocks[slot];
+    block.file = file;
+    block.offset = offset;
+    block.size = static_cast<uint32_t>(std::max<off_t>(bytesRead, cached_end));
+    block.dirty = false;
+    block.loading = false;
+    shard.index.insert(file->id, offset, slot);
+    shard.policy->insert(slot, detail::pair_hash()(std::make_pair(file->id, offset)));
+    file->last_block = offset;
+    return slot;
 }
 
 ssize_t BlockCache::write(file_descriptor_t fd, const void *buf, size_t count) {
-    off_t current_offset = lseek(fd, 0, SEEK_CUR);
-    if (current_offset == -1) {
-        std::cerr << "Error getting current offset: " << strerror(errno) << std::endl;
+    std::shared_ptr<OpenFile> file = findFile(fd);
+    if (!file) {
+        static write_func original_write = originalFunction<write_func>("write");
+        return original_write(fd, buf, count);
+    }
+    std::lock_guard<std::mutex> file_lock(file->lock);
+    if (file->closed || (file->flags & O_ACCMODE) == O_RDONLY) {
+        errno = EBADF;
         return -1;
     }
 
+    if (file->flags & O_APPEND) {
+        return appendThrough(file.get(), buf, count);
+    }
+
+    off_t current_offset = file->offset;
+
     size_t bytes_written = 0;
     while (bytes_written < count) {
         size_t block_offset = current_offset % BLOCK_SIZE;
@@ -158,96 +512,384 @@ ssize_t BlockCache::write(file_descriptor_t fd, const void *buf, size_t count) {
         size_t remaining_bytes = count - bytes_written;
         size_t write_size = std::min(remaining_bytes, BLOCK_SIZE - block_offset);
 
-        CacheBlock *block = getBlock(fd, block_start);
-        if (!block) {
-            block = loadBlock(fd, block_start);
-            if (!block) {
+        Shard &shard = shardOf(file.get(), block_start);
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        uint32_t slot = residentBlock(shard, lock, file.get(), block_start);
+        if (slot == detail::NO_BLOCK) {
+            bool whole_block = block_offset == 0 && write_size == BLOCK_SIZE;
+            slot = loadBlock(shard, lock, file.get(), block_start,
+                             !whole_block && block_start < file->size);
+            if (slot == detail::NO_BLOCK) {
                 return -1;
             }
         }
 
-        if (block_offset == 0 && write_size == BLOCK_SIZE) {
-            std::memcpy(block->data.data(), static_cast<const char *>(buf) + bytes_written, write_size);
-        } else {
-            std::memcpy(block->data.data() + block_offset, static_cast<const char *>(buf) + bytes_written, write_size);
+        CacheBlock &block = shard.blocks[slot];
+        char *data = shard.data(slot);
+        if (block.size < block_offset) {
+            std::memset(data + block.size, 0, block_offset - block.size);
         }
+        block.size = std::max<uint32_t>(block.size, block_offset + write_size);
+        std::memcpy(data + block_offset, static_cast<const char *>(buf) + bytes_written, write_size);
 
-        block->dirty = true;
+        block.dirty = true;
         bytes_written += write_size;
         current_offset += write_size;
-
+        file->size = std::max(file->size, current_offset);
     }
-    lseek(fd, current_offset, SEEK_SET);
+    file->offset = current_offset;
     return bytes_written;
 }
 
+off_t BlockCache::seek(file_descriptor_t fd, off_t offset, int whence) {
+    static lseek_func original_lseek = originalFunction<lseek_func>("lseek");
+    std::shared_ptr<OpenFile> file = findFile(fd);
+    if (!file) {
+        return original_lseek(fd, offset, whence);
+    }
+    std::lock_guard<std::mutex> file_lock(file->lock);
+
+    off_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = file->offset;
+            break;
+        case SEEK_END:
+            base = file->size;
+            break;
+        default: {
+            // SEEK_DATA / SEEK_HOLE need the file system's view of the file.
+            flushDirtyBlocksForFile(file.get());
+            off_t result = original_lseek(file->io_fd, offset, whence);
+            if (result != -1) {
+                file->offset = result;
+            }
+            return result;
+        }
+    }
+    if ((offset > 0 && base > std::numeric_limits<off_t>::max() - offset) || base + offset < 0) {
+        errno = (offset > 0) ? EOVERFLOW : EINVAL;
+        return -1;
+    }
+    file->offset = base + offset;
+    return file->offset;
+}
+
 
 int BlockCache::fsync(file_descriptor_t fd) {
-    flushDirtyBlocksForFd(fd);
+    static fsync_func original_fsync = originalFunction<fsync_func>("fsync");
+    std::shared_ptr<OpenFile> file = findFile(fd);
+    if (file) {
+        std::lock_guard<std::mutex> file_lock(file->lock);
+        flushDirtyBlocksForFile(file.get());
+    }
 
-    if (::fsync(fd) == -1) {
+    if (original_fsync(fd) == -1) {
         std::cerr << "Error in fsync (fsync): " << strerror(errno) << std::endl;
         return -1;
     }
     return 0;
 }
 
-void BlockCache::flushDirtyBlocksForFd(int fd) {
-    for (auto it = cache_list_.begin(); it != cache_list_.end();) {
-        if (it->fd == fd && it->dirty) {
-            flushBlock(*it);
+ssize_t BlockCache::appendThrough(OpenFile *file, const void *buf, size_t count) {
+    static write_func original_write = originalFunction<write_func>("write");
+    static lseek_func original_lseek = originalFunction<lseek_func>("lseek");
+    ssize_t written = original_write(file->io_fd, buf, count);
+    if (written == -1) {
+        return -1;
+    }
+    // The kernel leaves the offset at the end of what it appended. Other
+    // processes may have appended since the size was last seen, so blocks
+    // from the old end on may be stale as well as the ones just written.
+    off_t end = original_lseek(file->io_fd, 0, SEEK_CUR);
+    if (end == -1) {
+        struct stat st;
+        end = fstat(file->io_fd, &st) == -1 ? file->size + written : st.st_size;
+    }
+    off_t stale = std::min<off_t>(file->size, end - written);
+    for (off_t block_start = stale - stale % BLOCK_SIZE; block_start < end;
+         block_start += BLOCK_SIZE) {
+        Shard &shard = shardOf(file, block_start);
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        uint32_t slot = residentBlock(shard, lock, file, block_start);
+        if (slot != detail::NO_BLOCK) {
+            dropBlock(shard, slot);
+        }
+    }
+    file->size = std::max(file->size, end);
+    file->offset = end;
+    return written;
+}
+
+void BlockCache::flushDirtyBlocksForFile(OpenFile *file) {
+    for (auto &shard: shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->lock);
+        for (uint32_t slot = 0; slot < shard->blocks.size(); ++slot) {
+            if (shard->blocks[slot].file == file && shard->blocks[slot].dirty) {
+                flushBlock(*shard, slot);
+            }
         }
-        if (it->fd == fd && !it->dirty) {
-            it++;
+    }
+}
+
+void BlockCache::readAhead(OpenFile *file, off_t start, off_t end) {
+    if (!aio_context_ || file->readahead_fd == -1) {
+        return;
+    }
+    if (start != file->readahead_expected) {
+        // A seek: no read-ahead until reads are sequential again.
+        file->readahead_expected = end;
+        file->readahead_window = 0;
+        file->readahead_end = 0;
+        return;
+    }
+    file->readahead_expected = end;
+
+    // The block holding `end` was just read; read-ahead starts after it.
+    off_t next = (end + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    off_t ahead = std::max<off_t>(file->readahead_end - next, 0) / BLOCK_SIZE;
+    // Top up once half of the window has been consumed, doubling it.
+    if (file->readahead_window > 0 && ahead > static_cast<off_t>(file->readahead_window / 2)) {
+        return;
+    }
+    file->readahead_window = file->readahead_window == 0
+                             ? std::min(CACHE_READAHEAD_MIN_WINDOW, readahead_max_window_)
+                             : std::min(file->readahead_window * 2, readahead_max_window_);
+    off_t from = std::max(file->readahead_end, next);
+    off_t to = std::min<off_t>(next + file->readahead_window * BLOCK_SIZE, file->size);
+    if (from < to) {
+        std::lock_guard<std::mutex> aio_lock(aio_lock_);
+        file->readahead_end = submitReadAhead(file, from, to);
+    }
+}
+
+off_t BlockCache::submitReadAhead(OpenFile *file, off_t from, off_t to) {
+    reapReadAhead();
+    ReadAhead *loads[CACHE_READAHEAD_DEPTH];
+    size_t count = 0;
+    // The load that the next block extends, null after a cached block.
+    ReadAhead *request = nullptr;
+    off_t offset = from;
+    for (; offset < to; offset += BLOCK_SIZE) {
+        Shard &shard = shardOf(file, offset);
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        if (shard.index.find(file->id, offset) != detail::NO_BLOCK) {
+            request = nullptr;
             continue;
         }
-        it++;
+        applyHits(shard);
+        if (shard.free_slots.empty()) {
+            evictBlock(shard);
+        }
+        if (shard.free_slots.empty()) {
+            // Every slot of the shard is being loaded.
+            break;
+        }
+        if (!request || request->blocks == CACHE_READAHEAD_RUN) {
+            if (free_readaheads_.empty()) {
+                break;
+            }
+            request = &readaheads_[free_readaheads_.back()];
+            free_readaheads_.pop_back();
+            request->file = file;
+            request->offset = offset;
+            request->file_size = file->size;
+            request->blocks = 0;
+            loads[count++] = request;
+            ++file->readahead_inflight;
+        }
+        uint32_t slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+        shard.blocks[slot] = CacheBlock{file, offset, 0, false, true};
+        shard.index.insert(file->id, offset, slot);
+        request->shards[request->blocks] = &shard;
+        request->slots[request->blocks] = slot;
+        request->iov[request->blocks] = iovec{shard.data(slot), BLOCK_SIZE};
+        ++request->blocks;
+    }
+    if (count == 0) {
+        return offset;
+    }
+    struct iocb *batch[CACHE_READAHEAD_DEPTH];
+    for (size_t i = 0; i < count; ++i) {
+        io_prep_preadv(&loads[i]->iocb, file->readahead_fd, loads[i]->iov,
+                       static_cast<int>(loads[i]->blocks), loads[i]->offset);
+        loads[i]->iocb.data = loads[i];
+        batch[i] = &loads[i]->iocb;
+    }
+
+    int submitted = io_submit(aio_context_, count, batch);
+    if (submitted < 0) {
+        std::cerr << "Error in io_submit: " << strerror(-submitted) << std::endl;
+        submitted = 0;
+    }
+    if (static_cast<size_t>(submitted) == count) {
+        return offset;
+    }
+    // Give back the slots of the loads that did not start.
+    offset = loads[submitted]->offset;
+    for (size_t i = submitted; i < count; ++i) {
+        completeReadAhead(*loads[i], -ECANCELED);
+    }
+    return offset;
+}
+
+void BlockCache::reapReadAhead() {
+    if (reaping_) {
+        return;
+    }
+    struct io_event events[CACHE_READAHEAD_DEPTH];
+    int count = io_getevents(aio_context_, 0, CACHE_READAHEAD_DEPTH, events, nullptr);
+    for (int i = 0; i < count; ++i) {
+        completeReadAhead(*static_cast<ReadAhead *>(events[i].data),
+                          static_cast<long>(events[i].res));
+    }
+}
+
+void BlockCache::awaitReadAhead(std::unique_lock<std::mutex> &aio_lock) {
+    if (reaping_) {
+        uint64_t round = reap_rounds_;
+        readahead_done_.wait(aio_lock, [&] { return reap_rounds_ != round; });
+        return;
+    }
+    // Nobody else reaps meanwhile, so the loads the caller waits for are
+    // still in flight and io_getevents returns once one of them is done.
+    reaping_ = true;
+    aio_lock.unlock();
+    struct io_event events[CACHE_READAHEAD_DEPTH];
+    int count;
+    do {
+        count = io_getevents(aio_context_, 1, CACHE_READAHEAD_DEPTH, events, nullptr);
+    } while (count == -EINTR);
+    aio_lock.lock();
+    if (count < 0) {
+        std::cerr << "Error in io_getevents: " << strerror(-count) << std::endl;
+    }
+    for (int i = 0; i < count; ++i) {
+        completeReadAhead(*static_cast<ReadAhead *>(events[i].data),
+                          static_cast<long>(events[i].res));
+    }
+    reaping_ = false;
+    ++reap_rounds_;
+    readahead_done_.notify_all();
+}
+
+void BlockCache::completeReadAhead(ReadAhead &request, long result) {
+    // On failure the blocks are simply not cached; a read loads them again.
+    if (result < 0 && result != -ECANCELED) {
+        std::cerr << "Error in read-ahead: " << strerror(-result) << std::endl;
+    }
+    for (size_t i = 0; i < request.blocks; ++i) {
+        Shard &shard = *request.shards[i];
+        uint32_t slot = request.slots[i];
+        std::unique_lock<std::shared_mutex> lock(shard.lock);
+        CacheBlock &block = shard.blocks[slot];
+        if (result < 0) {
+            shard.index.erase(block.file->id, block.offset);
+            block.file = nullptr;
+            shard.free_slots.push_back(slot);
+        } else {
+            // The part of the block that was read, and the part below the
+            // cached file size, which reads as zeros past what was read.
+            off_t start = static_cast<off_t>(i * BLOCK_SIZE);
+            off_t read = std::max<off_t>(std::min<off_t>(result - start, BLOCK_SIZE), 0);
+            off_t cached_end = std::max<off_t>(
+                    std::min<off_t>(request.file_size - block.offset, BLOCK_SIZE), 0);
+            if (cached_end > read) {
+                std::memset(shard.data(slot) + read, 0, cached_end - read);
+            }
+            block.size = static_cast<uint32_t>(std::max(read, cached_end));
+            shard.policy->insert(slot,
+                                 detail::pair_hash()(std::make_pair(block.file->id, block.offset)));
+        }
+        block.loading = false;
+    }
+    --request.file->readahead_inflight;
+    free_readaheads_.push_back(static_cast<uint32_t>(&request - readaheads_.data()));
+}
+
+void BlockCache::waitForBlock(Shard &shard, uint32_t slot) {
+    std::unique_lock<std::mutex> aio_lock(aio_lock_);
+    for (;;) {
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.lock);
+            if (!shard.blocks[slot].loading) {
+                return;
+            }
+        }
+        awaitReadAhead(aio_lock);
+    }
+}
 
+void BlockCache::waitForAnyReadAhead() {
+    std::unique_lock<std::mutex> aio_lock(aio_lock_);
+    // Another thread may have reaped the last load since the caller looked.
+    if (free_readaheads_.size() < readaheads_.size()) {
+        awaitReadAhead(aio_lock);
     }
 }
 
-void BlockCache::evictBlock() {
-    if (cache_list_.empty()) {
+void BlockCache::waitForReadAhead(OpenFile *file) {
+    if (!aio_context_) {
         return;
     }
+    std::unique_lock<std::mutex> aio_lock(aio_lock_);
+    while (file->readahead_inflight > 0) {
+        awaitReadAhead(aio_lock);
+    }
+}
 
-    auto last = cache_list_.back();
-    if (last.dirty) {
-        flushBlock(last);
+void BlockCache::evictBlock(Shard &shard) {
+    uint32_t slot = shard.policy->victim();
+    if (slot == detail::NO_BLOCK) {
+        return;
     }
 
-    cache_map_.erase({last.fd, last.offset});
-    cache_list_.pop_back();
+    if (shard.blocks[slot].dirty) {
+        flushBlock(shard, slot);
+    }
+    dropBlock(shard, slot);
 }
 
 
 extern "C" int cache_init(size_t cache_size) {
-    if (g_cache != nullptr) {
+    const char *policy = getenv("CACHE_POLICY");
+    return cache_init_policy(cache_size, policy ? policy : DEFAULT_REPLACEMENT_POLICY);
+}
+
+extern "C" int cache_init_policy(size_t cache_size, const char *policy) {
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+    if (g_cache.load() != nullptr) {
         std::cerr << "Cache already initialized." << std::endl;
         return -1;
     }
-    g_cache = new BlockCache(cache_size);
-    std::cout << "Cache initialized with size: " << cache_size << std::endl;
+    try {
+        g_cache.store(new BlockCache(cache_size, policy), std::memory_order_release);
+    } catch (const std::invalid_argument &) {
+        return -1;
+    }
+    std::cout << "Cache initialized with size: " << cache_size << ", policy: " << policy
+              << std::endl;
     return 0;
 }
 
 extern "C" void cache_destroy() {
-    if (g_cache != nullptr) {
-        delete g_cache;
-        g_cache = nullptr;
+    std::lock_guard<std::mutex> lock(g_cache_lock);
+    BlockCache *cache = g_cache.exchange(nullptr);
+    if (cache != nullptr) {
+        delete cache;
         std::cout << "Cache destroyed." << std::endl;
     }
 }
 
 extern "C" int open(const char *pathname, int flags, ...) {
-    static open_func original_open = nullptr;
+    static open_func original_open = originalFunction<open_func>("open");
     if (!original_open) {
-        original_open = (open_func) dlsym(RTLD_NEXT, "open");
-        if (!original_open) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
     va_list args;
     va_start(args, flags);
@@ -258,95 +900,166 @@ extern "C" int open(const char *pathname, int flags, ...) {
     va_end(args);
 
 
-    if (g_cache == nullptr) {
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
         return original_open(pathname, flags, mode);
     }
-    return g_cache->openFile(pathname, flags, mode);
+    return cache->openFile(pathname, flags, mode);
 }
 
 
 
 extern "C" ssize_t read(int fd, void *buf, size_t count) {
-    static read_func original_read = nullptr;
+    static read_func original_read = originalFunction<read_func>("read");
     if (!original_read) {
-        original_read = (read_func) dlsym(RTLD_NEXT, "read");
-        if (!original_read) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    if (g_cache == nullptr) {
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
         return original_read(fd, buf, count);
     }
-    return g_cache->read(fd, buf, count);
+    return cache->read(fd, buf, count);
 }
 
 
 extern "C" ssize_t write(int fd, const void *buf, size_t count) {
-    static write_func original_write = nullptr;
+    static write_func original_write = originalFunction<write_func>("write");
     if (!original_write) {
-        original_write = (write_func) dlsym(RTLD_NEXT, "write");
-        if (!original_write) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    if (g_cache == nullptr) {
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
         return original_write(fd, buf, count);
     }
-    return g_cache->write(fd, buf, count);
+    return cache->write(fd, buf, count);
 }
 
 
 extern "C" int close(int fd) {
-    static close_func original_close = nullptr;
+    static close_func original_close = originalFunction<close_func>("close");
     if (!original_close) {
-        original_close = (close_func) dlsym(RTLD_NEXT, "close");
-        if (!original_close) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    if (g_cache == nullptr) {
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
         return original_close(fd);
     }
 
 
-    int result = g_cache->closeFile(fd);
-    if (result != 0) {
-        return result;
-    }
+    cache->closeFile(fd);
     return original_close(fd);
 }
 extern "C" off_t lseek(int fd, off_t offset, int whence) {
-    static lseek_func original_lseek = nullptr;
+    static lseek_func original_lseek = originalFunction<lseek_func>("lseek");
     if (!original_lseek) {
-        original_lseek = (lseek_func) dlsym(RTLD_NEXT, "lseek");
-        if (!original_lseek) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    return original_lseek(fd, offset, whence);
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
+        return original_lseek(fd, offset, whence);
+    }
+    return cache->seek(fd, offset, whence);
 }
 
 
 extern "C" int fsync(int fd) {
-    static fsync_func original_fsync = nullptr;
+    static fsync_func original_fsync = originalFunction<fsync_func>("fsync");
     if (!original_fsync) {
-        original_fsync = (fsync_func) dlsym(RTLD_NEXT, "fsync");
-        if (!original_fsync) {
-            std::cerr << "dlsym error: " << dlerror() << std::endl;
-            errno = EIO;
-            return -1;
-        }
+        errno = EIO;
+        return -1;
     }
-    if (g_cache == nullptr) {
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache == nullptr) {
         return original_fsync(fd);
     }
-    return g_cache->fsync(fd);
+    return cache->fsync(fd);
+}
+
+
+extern "C" int dup(int oldfd) {
+    static dup_func original_dup = originalFunction<dup_func>("dup");
+    if (!original_dup) {
+        errno = EIO;
+        return -1;
+    }
+    int newfd = original_dup(oldfd);
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache != nullptr && newfd != -1) {
+        cache->duplicateFd(oldfd, newfd);
+    }
+    return newfd;
+}
+
+extern "C" int dup2(int oldfd, int newfd) {
+    static dup2_func original_dup2 = originalFunction<dup2_func>("dup2");
+    if (!original_dup2) {
+        errno = EIO;
+        return -1;
+    }
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache != nullptr && oldfd != newfd && fcntl(oldfd, F_GETFD) != -1) {
+        // dup2 closes newfd first; its dirty blocks must go out before.
+        cache->closeFile(newfd);
+    }
+    int result = original_dup2(oldfd, newfd);
+    if (cache != nullptr && result != -1) {
+        cache->duplicateFd(oldfd, newfd);
+    }
+    return result;
+}
+
+extern "C" int dup3(int oldfd, int newfd, int flags) {
+    static dup3_func original_dup3 = originalFunction<dup3_func>("dup3");
+    if (!original_dup3) {
+        errno = EIO;
+        return -1;
+    }
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache != nullptr && oldfd != newfd && fcntl(oldfd, F_GETFD) != -1) {
+        cache->closeFile(newfd);
+    }
+    int result = original_dup3(oldfd, newfd, flags);
+    if (cache != nullptr && result != -1) {
+        cache->duplicateFd(oldfd, newfd);
+    }
+    return result;
+}
+
+// F_DUPFD and F_DUPFD_CLOEXEC duplicate fd like dup(). Every command takes
+// at most one argument, an int or a pointer, which is passed on as is.
+static int duplicatingFcntl(fcntl_func original_fcntl, int fd, int cmd, va_list args) {
+    if (!original_fcntl) {
+        errno = EIO;
+        return -1;
+    }
+    void *arg = va_arg(args, void *);
+    int result = original_fcntl(fd, cmd, arg);
+    BlockCache *cache = g_cache.load(std::memory_order_acquire);
+    if (cache != nullptr && result != -1 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)) {
+        cache->duplicateFd(fd, result);
+    }
+    return result;
+}
+
+extern "C" int fcntl(int fd, int cmd, ...) {
+    static fcntl_func original_fcntl = originalFunction<fcntl_func>("fcntl");
+    va_list args;
+    va_start(args, cmd);
+    int result = duplicatingFcntl(original_fcntl, fd, cmd, args);
+    va_end(args);
+    return result;
+}
+
+// What fcntl() calls resolve to when built with _FILE_OFFSET_BITS=64.
+extern "C" int fcntl64(int fd, int cmd, ...) {
+    static fcntl_func original_fcntl64 = originalFunction<fcntl_func>("fcntl64");
+    va_list args;
+    va_start(args, cmd);
+    int result = duplicatingFcntl(original_fcntl64, fd, cmd, args);
+    va_end(args);
+    return result;
 }
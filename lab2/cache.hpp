@@ -2,8 +2,14 @@
 #define CACHE_H
 
 #include <fcntl.h>
-#include <list>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 #include <libaio.h>
@@ -11,9 +17,11 @@
 #include <cstdint>
 #include <iostream>
 #include <unordered_map>
+#include "replacement_policy.hpp"
 
 using file_descriptor_t = int;
 using file_offset_t = off_t;
+using file_id_t = uint64_t;
 
 namespace detail {
 
@@ -59,52 +67,313 @@ namespace detail {
             return XXH3_64bits(combined, sizeof(combined));
         }
     };
+
+    // Map from (file, block offset) to a slab slot. Open addressing with
+    // linear probing, sized once for the whole cache, so lookups and
+    // updates never allocate. Erase shifts the following entries back
+    // instead of leaving tombstones.
+    class BlockIndex {
+    public:
+        explicit BlockIndex(size_t blocks) {
+            size_t capacity = 16;
+            while (capacity < blocks * 2) {
+                capacity *= 2;
+            }
+            entries_.assign(capacity, Entry{0, 0, NO_BLOCK});
+            mask_ = capacity - 1;
+        }
+
+        uint32_t find(uint64_t file, off_t offset) const {
+            for (size_t i = bucket(file, offset);; i = (i + 1) & mask_) {
+                const Entry &entry = entries_[i];
+                if (entry.slot == NO_BLOCK) {
+                    return NO_BLOCK;
+                }
+                if (entry.file == file && entry.offset == offset) {
+                    return entry.slot;
+                }
+            }
+        }
+
+        void insert(uint64_t file, off_t offset, uint32_t slot) {
+            size_t i = bucket(file, offset);
+            while (entries_[i].slot != NO_BLOCK &&
+                   !(entries_[i].file == file && entries_[i].offset == offset)) {
+                i = (i + 1) & mask_;
+            }
+            entries_[i] = Entry{file, offset, slot};
+        }
+
+        void erase(uint64_t file, off_t offset) {
+            size_t i = bucket(file, offset);
+            while (entries_[i].slot != NO_BLOCK &&
+                   !(entries_[i].file == file && entries_[i].offset == offset)) {
+                i = (i + 1) & mask_;
+            }
+            if (entries_[i].slot == NO_BLOCK) {
+                return;
+            }
+            // Move back every later entry of the run that may sit in the hole.
+            for (size_t j = (i + 1) & mask_; entries_[j].slot != NO_BLOCK; j = (j + 1) & mask_) {
+                size_t home = bucket(entries_[j].file, entries_[j].offset);
+                if (((j - home) & mask_) >= ((j - i) & mask_)) {
+                    entries_[i] = entries_[j];
+                    i = j;
+                }
+            }
+            entries_[i].slot = NO_BLOCK;
+        }
+
+    private:
+        struct Entry {
+            uint64_t file;
+            off_t offset;
+            uint32_t slot;
+        };
+
+        size_t bucket(uint64_t file, off_t offset) const {
+            return pair_hash()(std::make_pair(file, offset)) & mask_;
+        }
+
+        std::vector<Entry> entries_;
+        size_t mask_;
+    };
 }
 
 
+// The cache is split into up to CACHE_MAX_SHARDS shards of at least
+// CACHE_MIN_SHARD_BLOCKS blocks each.
+const size_t CACHE_MAX_SHARDS = 16;
+const size_t CACHE_MIN_SHARD_BLOCKS = 64;
+// Hits a shard notes before they reach its replacement policy.
+const size_t CACHE_HIT_BUFFER_SIZE = 64;
+// The fd table is split by fd into this many stripes with a lock each.
+const size_t CACHE_FILE_STRIPES = 16;
+// Sequential reads load the blocks ahead of them through libaio: at most
+// DEPTH loads are in flight, each one preadv of up to RUN consecutive
+// blocks, and the window per file starts at the min and doubles up to the
+// max (and a quarter of the cache) while reads stay sequential. The loads
+// go through a second, O_DIRECT fd of the file: native AIO on a buffered fd
+// does the read inside io_submit. Files whose file system refuses O_DIRECT
+// get no read-ahead.
+const size_t CACHE_READAHEAD_DEPTH = 64;
+const size_t CACHE_READAHEAD_RUN = 16;
+const size_t CACHE_READAHEAD_MIN_WINDOW = 4;
+const size_t CACHE_READAHEAD_MAX_WINDOW = 64;
+
+// Safe to use from several threads. Each file description has a mutex that
+// orders reads, writes and seeks through it, as the kernel does for the
+// file offset; blocks are split over shards with a lock each, so threads
+// working on different fds rarely wait for each other.
 class BlockCache {
 public:
-    explicit BlockCache(size_t cache_size);
+    // `policy` names the replacement policy, see makeReplacementPolicy.
+    // An unknown name throws std::invalid_argument.
+    explicit BlockCache(size_t cache_size,
+                        const std::string &policy = DEFAULT_REPLACEMENT_POLICY);
 
     ~BlockCache();
 
     file_descriptor_t openFile(const std::string &path, int flags, int mode);
 
+    // Forgets fd before the caller closes it. Blocks of its file are
+    // flushed and dropped once no other (dup'd) fd refers to the file.
     int closeFile(file_descriptor_t fd);
 
+    // Makes newfd share oldfd's file, offset included, as dup() does.
+    void duplicateFd(file_descriptor_t oldfd, file_descriptor_t newfd);
+
     ssize_t read(int fd, void *buf, size_t count);
 
     ssize_t write(int fd, const void *buf, size_t count);
 
+    off_t seek(file_descriptor_t fd, off_t offset, int whence);
+
     int fsync(file_descriptor_t fd);
 
+    // One open file description: what open() returned, shared by every fd
+    // dup'd from it. The offset and size live here, so reads, writes and
+    // seeks on cached blocks need no syscall. Blocks are read and written
+    // with pread/pwrite on io_fd, and read ahead through readahead_fd.
+    struct OpenFile {
+        file_id_t id;
+        std::atomic<file_descriptor_t> io_fd;
+        // Opened by the cache with O_DIRECT, -1 if there is none; closed
+        // with the last fd.
+        file_descriptor_t readahead_fd;
+        // The rest is guarded by lock.
+        std::mutex lock;
+        std::vector<file_descriptor_t> fds;
+        off_t offset;
+        off_t size;
+        int flags;
+        // Block touched last. Further hits on it, as from small sequential
+        // reads, are one reference as far as the replacement policy goes.
+        off_t last_block;
+        bool closed;
+        // Where a read continuing the last one starts, the read-ahead
+        // window in blocks (0 while reads are not sequential) and the end
+        // of what was read ahead.
+        off_t readahead_expected;
+        size_t readahead_window;
+        off_t readahead_end;
+        size_t readahead_inflight;  // guarded by aio_lock_
+    };
+
+    // Metadata of one slab slot. The data lives in the shard's part of the
+    // slab at the same index; file is null while the slot is free. A block
+    // that is loading is being read ahead: it is in the index but not yet
+    // in the policy, so it cannot be evicted, and users wait for it.
     struct CacheBlock {
-        int fd;
+        OpenFile *file;
         off_t offset;
-        std::vector<char> data;
+        uint32_t size;  // valid bytes
         bool dirty;
+        bool loading;
+    };
+
+    // A slice of the cache with its own part of the slab, index, policy and
+    // lock. A block lives in the shard picked by its (file, offset) hash.
+    // Reads that hit take the lock shared and only note the slot in `hits`;
+    // the policy hears of them in one batch the next time the lock is held
+    // exclusively, before it picks a victim. Hits past a full buffer are
+    // not counted.
+    struct Shard {
+        Shard(char *slab, size_t blocks, const std::string &policy);
+
+        char *data(uint32_t slot) const;
+
+        std::shared_mutex lock;
+        char *slab;
+        std::vector<CacheBlock> blocks;
+        std::vector<uint32_t> free_slots;
+        std::unique_ptr<ReplacementPolicy> policy;
+        detail::BlockIndex index;
+        std::atomic<size_t> hit_count{0};
+        uint32_t hits[CACHE_HIT_BUFFER_SIZE];
+    };
+
+private:
+    // One asynchronous load of consecutive blocks, each into its own slot.
+    struct ReadAhead {
+        struct iocb iocb;
+        OpenFile *file;
+        off_t offset;     // of the first block
+        off_t file_size;  // the cached size when submitted
+        size_t blocks;
+        Shard *shards[CACHE_READAHEAD_RUN];
+        uint32_t slots[CACHE_READAHEAD_RUN];
+        struct iovec iov[CACHE_READAHEAD_RUN];
+    };
+
+    struct FileStripe {
+        mutable std::shared_mutex lock;
+        std::unordered_map <file_descriptor_t, std::shared_ptr<OpenFile>> files;
     };
 
-    CacheBlock *loadBlock(int fd, off_t offset);
+    FileStripe &stripeOf(file_descriptor_t fd) const;
+
+    std::shared_ptr<OpenFile> findFile(file_descriptor_t fd) const;
+
+    Shard &shardOf(const OpenFile *file, off_t offset);
+
+    // Copies bytes of a cached block under the shared lock. Returns false
+    // if the block is missing or too short, and the caller must take the
+    // shard exclusively.
+    bool readCached(Shard &shard, OpenFile *file, off_t block_start, size_t block_offset,
+                    size_t size, char *dest);
+
+    // The rest need the shard's lock held exclusively.
+
+    // Hands the buffered hits to the policy.
+    void applyHits(Shard &shard);
+
+    uint32_t getBlock(Shard &shard, OpenFile *file, off_t offset);
+
+    // getBlock, but waits while the block is being read ahead, unlocking
+    // the shard meanwhile.
+    uint32_t residentBlock(Shard &shard, std::unique_lock<std::shared_mutex> &lock,
+                           OpenFile *file, off_t offset);
+
+    // Loads the block at offset. With fill == false the block starts out
+    // empty instead of being read, for blocks that are about to be
+    // overwritten completely or lie past the end of the file. If every slot
+    // of the shard is being read ahead, waits for a load, unlocking the
+    // shard meanwhile.
+    uint32_t loadBlock(Shard &shard, std::unique_lock<std::shared_mutex> &lock,
+                       OpenFile *file, off_t offset, bool fill = true);
 
-    CacheBlock *getBlock(int fd, off_t offset);
+    void evictBlock(Shard &shard);
 
-    void evictBlock();
+    void flushBlock(Shard &shard, uint32_t slot);
 
-    void flushBlock(CacheBlock &block);
+    // Removes the block from the index and the policy and frees its slot.
+    void dropBlock(Shard &shard, uint32_t slot);
 
     void flushAllDirtyBlocks();
 
-    void flushDirtyBlocksForFd(int fd);
+    void flushDirtyBlocksForFile(OpenFile *file);
+
+    // Called with the file locked. Writes to an O_APPEND file go straight
+    // to the kernel, which appends atomically with respect to every other
+    // writer, and drop the cached blocks from the old end of the file on.
+    ssize_t appendThrough(OpenFile *file, const void *buf, size_t count);
+
+    // Called with the file locked after a read of [start, end). Grows or
+    // resets the file's window and submits loads for the blocks ahead.
+    void readAhead(OpenFile *file, off_t start, off_t end);
+
+    // The rest need aio_lock_, and no shard lock held.
+
+    // Starts loading the blocks in [from, to) that are not cached. Returns
+    // where it stopped: at `to` unless it ran out of requests or slots.
+    off_t submitReadAhead(OpenFile *file, off_t from, off_t to);
+
+    // Completes the loads that have finished, without waiting. Skipped
+    // while a thread waits in awaitReadAhead: what it reaps is its own.
+    void reapReadAhead();
+
+    // Waits until a load in flight has been completed, with aio_lock_
+    // released meanwhile. One thread at a time blocks in io_getevents and
+    // completes what it reaps; the others sleep on readahead_done_ until
+    // it is done, then look again.
+    void awaitReadAhead(std::unique_lock<std::mutex> &aio_lock);
+
+    void completeReadAhead(ReadAhead &request, long result);
+
+    // Take aio_lock_ themselves.
+    void waitForBlock(Shard &shard, uint32_t slot);
+
+    // Waits for one load to finish, if any is in flight.
+    void waitForAnyReadAhead();
+
+    void waitForReadAhead(OpenFile *file);
 
-private:
     size_t cache_size_;
-    std::list <CacheBlock> cache_list_;
-    std::unordered_map <std::pair<int, off_t>, std::list<CacheBlock>::iterator, detail::pair_hash> cache_map_;
+    // cache_size_ blocks of BLOCK_SIZE bytes, page aligned, allocated once
+    // and cut into one part per shard.
+    char *slab_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    size_t shard_mask_;
+    mutable FileStripe file_stripes_[CACHE_FILE_STRIPES];
+    std::atomic<file_id_t> next_file_id_{0};
+    // Null if io_setup failed; there is no read-ahead then.
     io_context_t aio_context_;
+    size_t readahead_max_window_;
+    std::mutex aio_lock_;
+    std::vector<ReadAhead> readaheads_;
+    std::vector<uint32_t> free_readaheads_;  // guarded by aio_lock_
+    // Whether a thread is in io_getevents, and how many times one has come
+    // back from it; guarded by aio_lock_.
+    bool reaping_ = false;
+    uint64_t reap_rounds_ = 0;
+    std::condition_variable readahead_done_;
 };
 
+// Uses the replacement policy named by the CACHE_POLICY environment
+// variable, LRU if it is unset.
 extern "C" int cache_init(size_t cache_size);
+extern "C" int cache_init_policy(size_t cache_size, const char *policy);
 extern "C" void cache_destroy();
 
 #endif
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "replacement_policy.hpp"
+
+// Hit ratios of the BlockCache replacement policies on synthetic block
+// traces. The policies are driven the way BlockCache drives them, without
+// any I/O, so a run takes seconds:
+//
+//   zipf  blocks drawn from a Zipf distribution over --blocks blocks
+//   scan  the same, with a sequential scan of never reused blocks, twice the
+//         cache size long, after every --scan-every accesses
+//   loop  a cyclic pass over 1.5 times the cache size (LRU never hits)
+//
+// Build: g++ -std=c++17 -O2 -o cache_bench cache_bench.cpp
+
+using Trace = std::vector<uint64_t>;
+
+class ZipfGenerator {
+public:
+    ZipfGenerator(size_t items, double alpha) : cdf_(items) {
+        double sum = 0;
+        for (size_t i = 0; i < items; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i + 1), alpha);
+            cdf_[i] = sum;
+        }
+        for (double &value: cdf_) {
+            value /= sum;
+        }
+    }
+
+    // Item 0 is the most popular; ids are scattered so that popular blocks
+    // are not neighbours.
+    uint64_t operator()(std::mt19937_64 &generator) {
+        double u = std::uniform_real_distribution<double>(0, 1)(generator);
+        size_t rank = std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        rank = std::min(rank, cdf_.size() - 1);
+        return (rank * 0x9e3779b97f4a7c15ULL) % cdf_.size();
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+Trace zipfTrace(size_t accesses, size_t blocks, double alpha, uint64_t seed) {
+    std::mt19937_64 generator(seed);
+    ZipfGenerator zipf(blocks, alpha);
+    Trace trace(accesses);
+    for (uint64_t &block: trace) {
+        block = zipf(generator);
+    }
+    return trace;
+}
+
+Trace scanTrace(size_t accesses, size_t blocks, double alpha, size_t cache_blocks,
+                size_t scan_every, uint64_t seed) {
+    std::mt19937_64 generator(seed);
+    ZipfGenerator zipf(blocks, alpha);
+    Trace trace;
+    trace.reserve(accesses);
+    uint64_t next_scan_block = blocks;
+    while (trace.size() < accesses) {
+        for (size_t i = 0; i < scan_every && trace.size() < accesses; ++i) {
+            trace.push_back(zipf(generator));
+        }
+        for (size_t i = 0; i < 2 * cache_blocks && trace.size() < accesses; ++i) {
+            trace.push_back(next_scan_block++);
+        }
+    }
+    return trace;
+}
+
+Trace loopTrace(size_t accesses, size_t cache_blocks) {
+    size_t loop = cache_blocks + cache_blocks / 2;
+    Trace trace(accesses);
+    for (size_t i = 0; i < accesses; ++i) {
+        trace[i] = i % loop;
+    }
+    return trace;
+}
+
+uint64_t blockKey(uint64_t block) {
+    uint64_t key = block + 0x9e3779b97f4a7c15ULL;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+// Replays the trace against a cache of `cache_blocks` slots and returns the
+// share of accesses that hit.
+double hitRatio(const std::string &policy_name, size_t cache_blocks, const Trace &trace) {
+    std::unique_ptr<ReplacementPolicy> policy = makeReplacementPolicy(policy_name, cache_blocks);
+    std::unordered_map<uint64_t, uint32_t> slots;
+    slots.reserve(cache_blocks * 2);
+    std::vector<uint64_t> blocks(cache_blocks);
+    std::vector<uint32_t> free_slots;
+    for (uint32_t slot = cache_blocks; slot-- > 0;) {
+        free_slots.push_back(slot);
+    }
+
+    size_t hits = 0;
+    for (uint64_t block: trace) {
+        auto it = slots.find(block);
+        if (it != slots.end()) {
+            policy->access(it->second);
+            ++hits;
+            continue;
+        }
+        if (free_slots.empty()) {
+            uint32_t victim = policy->victim();
+            policy->remove(victim);
+            slots.erase(blocks[victim]);
+            free_slots.push_back(victim);
+        }
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        blocks[slot] = block;
+        slots[block] = slot;
+        policy->insert(slot, blockKey(block));
+    }
+    return trace.empty() ? 0 : static_cast<double>(hits) / trace.size();
+}
+
+bool parseFlag(const std::string &arg, const std::string &name, std::string &value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+std::vector<std::string> splitList(const std::string &value) {
+    std::vector<std::string> items;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+void printUsage() {
+    std::cerr << "Usage: cache_bench [--policies=NAME,...] [--cache=BLOCKS,...]"
+                 " [--blocks=N] [--accesses=N] [--alpha=A] [--scan-every=N] [--seed=N]"
+              << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> policies = {"lru", "clock", "s3fifo"};
+    std::vector<size_t> cache_sizes = {1000, 10000};
+    size_t blocks = 100000;
+    size_t accesses = 2000000;
+    double alpha = 0.99;
+    size_t scan_every = 50000;
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value;
+        if (parseFlag(arg, "policies", value)) {
+            policies = splitList(value);
+        } else if (parseFlag(arg, "cache", value)) {
+            cache_sizes.clear();
+            for (const std::string &item: splitList(value)) {
+                cache_sizes.push_back(std::max<size_t>(1, std::stoul(item)));
+            }
+        } else if (parseFlag(arg, "blocks", value)) {
+            blocks = std::max<size_t>(1, std::stoul(value));
+        } else if (parseFlag(arg, "accesses", value)) {
+            accesses = std::stoul(value);
+        } else if (parseFlag(arg, "alpha", value)) {
+            alpha = std::stod(value);
+        } else if (parseFlag(arg, "scan-every", value)) {
+            scan_every = std::max<size_t>(1, std::stoul(value));
+        } else if (parseFlag(arg, "seed", value)) {
+            seed = std::stoull(value);
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    for (const std::string &policy: policies) {
+        if (!makeReplacementPolicy(policy, 1)) {
+            std::cerr << "Unknown replacement policy: " << policy << std::endl;
+            return 1;
+        }
+    }
+    if (cache_sizes.empty() || policies.empty()) {
+        printUsage();
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(4);
+    std::cout << std::setw(6) << "trace" << std::setw(10) << "cache";
+    for (const std::string &policy: policies) {
+        std::cout << std::setw(10) << policy;
+    }
+    std::cout << std::endl;
+
+    Trace zipf = zipfTrace(accesses, blocks, alpha, seed);
+    for (size_t cache_blocks: cache_sizes) {
+        Trace scan = scanTrace(accesses, blocks, alpha, cache_blocks, scan_every, seed);
+        Trace loop = loopTrace(accesses, cache_blocks);
+        const std::pair<const char *, const Trace *> traces[] = {
+                {"zipf", &zipf}, {"scan", &scan}, {"loop", &loop}};
+        for (const auto &trace: traces) {
+            std::cout << std::setw(6) << trace.first << std::setw(10) << cache_blocks;
+            for (const std::string &policy: policies) {
+                std::cout << std::setw(10) << hitRatio(policy, cache_blocks, *trace.second);
+            }
+            std::cout << std::endl;
+        }
+    }
+    return 0;
+}
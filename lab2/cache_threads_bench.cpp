@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Read throughput of the cache library from several threads. Every thread
+// opens the test file through the cache, reads it once to load its blocks,
+// and then, timed, reads random 4 KB blocks with lseek + read, checking the
+// block number stamped at the start of each. Blocks are cached per open
+// file, so the default --cache holds a copy of the file for every thread
+// and the timed part measures hits only.
+//
+// Build: g++ -std=c++17 -O2 -o cache_threads_bench cache_threads_bench.cpp -ldl -lpthread
+// Run:   cache_threads_bench ./cache.so [--threads=1,2,4,8] [--blocks=N] [--cache=N]
+//        [--reads=N] [--file=PATH]
+
+typedef int (*cache_init_func)(size_t);
+
+typedef void (*cache_destroy_func)();
+
+typedef int (*my_open_func)(const char *pathname, int flags, ...);
+
+typedef ssize_t (*my_read_func)(int fd, void *buf, size_t count);
+
+typedef int (*my_close_func)(int fd);
+
+typedef off_t (*my_lseek_func)(int fd, off_t offset, int whence);
+
+const size_t BENCH_BLOCK_SIZE = 4096;
+
+struct CacheFunctions {
+    my_open_func open;
+    my_read_func read;
+    my_close_func close;
+    my_lseek_func lseek;
+};
+
+bool parseFlag(const std::string &arg, const std::string &name, std::string &value) {
+    std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+bool writeTestFile(const std::string &path, size_t blocks) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::cerr << "Error creating " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::vector<char> block(BENCH_BLOCK_SIZE, 'x');
+    for (uint64_t i = 0; i < blocks; ++i) {
+        std::memcpy(block.data(), &i, sizeof(i));
+        if (::write(fd, block.data(), block.size()) != (ssize_t) block.size()) {
+            std::cerr << "Error writing " << path << ": " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+    }
+    ::close(fd);
+    return true;
+}
+
+struct StartGate {
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> open{false};
+};
+
+bool readBlock(const CacheFunctions &cache, int fd, uint64_t index, std::vector<char> &block) {
+    uint64_t stamp = ~index;
+    if (cache.lseek(fd, index * BENCH_BLOCK_SIZE, SEEK_SET) == -1 ||
+        cache.read(fd, block.data(), block.size()) != (ssize_t) block.size()) {
+        return false;
+    }
+    std::memcpy(&stamp, block.data(), sizeof(stamp));
+    return stamp == index;
+}
+
+// Loads every block, waits at the gate, then does the timed reads. Returns
+// the number of blocks that did not read back correctly.
+size_t readBlocks(const CacheFunctions &cache, const std::string &path, size_t blocks,
+                  size_t reads, uint64_t seed, StartGate &gate) {
+    int fd = cache.open(path.c_str(), O_RDONLY);
+    gate.ready.fetch_add(fd == -1 ? 2 : 1);
+    if (fd == -1) {
+        return reads;
+    }
+    std::vector<char> block(BENCH_BLOCK_SIZE);
+    size_t errors = 0;
+    for (uint64_t index = 0; index < blocks; ++index) {
+        errors += !readBlock(cache, fd, index, block);
+    }
+    gate.ready.fetch_add(1);
+    while (!gate.open.load()) {
+        std::this_thread::yield();
+    }
+    std::mt19937_64 generator(seed);
+    for (size_t i = 0; i < reads; ++i) {
+        errors += !readBlock(cache, fd, generator() % blocks, block);
+    }
+    cache.close(fd);
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: cache_threads_bench <cache.so> [--threads=N,...] [--blocks=N]"
+                     " [--cache=N] [--reads=N] [--file=PATH]" << std::endl;
+        return 1;
+    }
+    std::vector<size_t> thread_counts = {1, 2, 4, 8};
+    size_t blocks = 4096;
+    size_t cache_blocks = 0;
+    size_t reads = 1000000;
+    std::string path = "cache_threads_bench.bin";
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value;
+        if (parseFlag(arg, "threads", value)) {
+            thread_counts.clear();
+            std::stringstream stream(value);
+            std::string item;
+            while (std::getline(stream, item, ',')) {
+                thread_counts.push_back(std::max<size_t>(1, std::stoul(item)));
+            }
+        } else if (parseFlag(arg, "blocks", value)) {
+            blocks = std::max<size_t>(1, std::stoul(value));
+        } else if (parseFlag(arg, "cache", value)) {
+            cache_blocks = std::stoul(value);
+        } else if (parseFlag(arg, "reads", value)) {
+            reads = std::stoul(value);
+        } else if (parseFlag(arg, "file", value)) {
+            path = value;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (cache_blocks == 0) {
+        cache_blocks = blocks * *std::max_element(thread_counts.begin(), thread_counts.end());
+    }
+
+    if (!writeTestFile(path, blocks)) {
+        return 1;
+    }
+    void *library = dlopen(argv[1], RTLD_NOW);
+    if (!library) {
+        std::cerr << "Error loading cache library: " << dlerror() << std::endl;
+        return 1;
+    }
+    auto cache_init = (cache_init_func) dlsym(library, "cache_init");
+    auto cache_destroy = (cache_destroy_func) dlsym(library, "cache_destroy");
+    CacheFunctions cache = {(my_open_func) dlsym(library, "open"),
+                            (my_read_func) dlsym(library, "read"),
+                            (my_close_func) dlsym(library, "close"),
+                            (my_lseek_func) dlsym(library, "lseek")};
+    if (!cache_init || !cache_destroy || !cache.open || !cache.read || !cache.close ||
+        !cache.lseek) {
+        std::cerr << "Error loading symbols from the cache library." << std::endl;
+        dlclose(library);
+        return 1;
+    }
+    if (cache_init(cache_blocks) != 0) {
+        dlclose(library);
+        return 1;
+    }
+
+    size_t errors = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    double single = 0;
+    for (size_t threads: thread_counts) {
+        std::vector<std::thread> workers;
+        std::vector<size_t> worker_errors(threads);
+        StartGate gate;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                worker_errors[t] = readBlocks(cache, path, blocks, reads / threads, t + 1, gate);
+            });
+        }
+        // Every thread passes ready twice: after open and after loading.
+        while (gate.ready.load() < 2 * threads) {
+            std::this_thread::yield();
+        }
+        auto start = std::chrono::steady_clock::now();
+        gate.open.store(true);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        for (size_t count: worker_errors) {
+            errors += count;
+        }
+        double rate = reads / 1e6 / std::max(duration.count(), 1e-9);
+        if (single == 0) {
+            single = rate;
+        }
+        std::cout << std::setw(3) << threads << " threads: " << rate << " Mreads/s, "
+                  << rate / single << "x" << std::endl;
+    }
+
+    cache_destroy();
+    dlclose(library);
+    ::unlink(path.c_str());
+    if (errors != 0) {
+        std::cerr << errors << " reads returned wrong data" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -2,8 +2,11 @@
 #include <fstream>
 #include <iomanip>
 #include <random>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_set>
+#include <vector>
 #include <unistd.h>
 #include <cerrno>
 #include <cstring>
@@ -11,6 +14,10 @@
 #include <chrono>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/line_scan.h"
 
 
 typedef int (*cache_init_func)(size_t);
@@ -67,18 +74,101 @@ void createInputFile(const std::string &filename, int num_lines,
     }
 }
 
+// Строка множества вместе с её хешем: хеш считается один раз, при emplace.
+// Новую строку после вставки перенаправляют на копию в хранилище (text
+// mutable); содержимое то же, поэтому хеш и сравнение не меняются.
+struct SetLine {
+    mutable std::string_view text;
+    size_t hash;
+
+    explicit SetLine(std::string_view line)
+            : text(line), hash(std::hash<std::string_view>()(line)) {}
+
+    bool operator==(const SetLine &other) const { return text == other.text; }
+};
+
+struct SetLineHash {
+    size_t operator()(const SetLine &line) const { return line.hash; }
+};
+
+using LineSet = std::unordered_set<SetLine, SetLineHash>;
+
+// Дедупликация через отображение файла в память: string_view указывают прямо
+// в отображение, строки не копируются. Чтение идёт мимо read(), поэтому кэш
+// в этом режиме не участвует.
+bool dedupMapped(const std::string &input_filename,
+                 LineSet &unique_lines,
+                 const char *&mapping, size_t &mapping_size) {
+    int fd = ::open(input_filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        std::cerr << "Ошибка открытия файла для чтения: " << input_filename
+                  << " - " << strerror(errno) << std::endl;
+        if (fd != -1) {
+            ::close(fd);
+        }
+        return false;
+    }
+    mapping_size = static_cast<size_t>(st.st_size);
+    mapping = nullptr;
+    if (mapping_size > 0) {
+        void *data = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "Ошибка отображения файла: " << input_filename
+                      << " - " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        mapping = static_cast<const char *>(data);
+        madvise(data, mapping_size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+
+    const char *end = mapping + mapping_size;
+    const char *tail = scan_lines(mapping, mapping_size,
+                                  [&](const char *line, size_t length) {
+                                      unique_lines.emplace(std::string_view(line, length));
+                                  });
+    if (tail < end) {
+        unique_lines.emplace(std::string_view(tail, end - tail));
+    }
+    return true;
+}
+
 void runDedup(int num_iterations, const std::string &input_filename,
               my_open_func my_open, my_read_func my_read, my_write_func my_write,
-              my_close_func my_close, my_lseek_func my_lseek, bool verbose) {
+              my_close_func my_close, my_lseek_func my_lseek, bool verbose,
+              bool use_mmap) {
 
     for (int i = 0; i < num_iterations; ++i) {
         int num_lines = 10000;
         int line_length = 50;
         createInputFile(input_filename, num_lines, line_length, my_open, my_write, my_close);
-        std::unordered_set<std::string> unique_lines;
+        LineSet unique_lines;
+        LineArena arena;
 
         auto start = std::chrono::high_resolution_clock::now();
 
+        if (use_mmap) {
+            const char *mapping = nullptr;
+            size_t mapping_size = 0;
+            if (!dedupMapped(input_filename, unique_lines, mapping, mapping_size)) {
+                return;
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            unique_lines.clear();
+            if (mapping != nullptr) {
+                munmap(const_cast<char *>(mapping), mapping_size);
+            }
+            if (verbose) {
+                std::cout << "Итерация " << i + 1 << ": "
+                          << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                  end - start).count()
+                          << " мс" << std::endl;
+            }
+            continue;
+        }
+
         int fd = my_open(input_filename.c_str(), O_RDONLY);
         if (fd == -1) {
             std::cerr << "Ошибка открытия файла для чтения: " << input_filename
@@ -86,22 +176,34 @@ void runDedup(int num_iterations, const std::string &input_filename,
             return;
         }
 
-        std::string line;
+        // Строка, разорванная границей буфера, собирается в carry. В
+        // хранилище копируются только строки, которых ещё нет в множестве:
+        // один emplace и ищет строку, и вставляет её.
+        std::string carry;
         std::vector<char> buffer(1024);
         ssize_t bytesRead;
+        auto insert = [&](std::string_view line) {
+            auto [it, added] = unique_lines.emplace(line);
+            if (added) {
+                it->text = arena.store(line.data(), line.size());
+            }
+        };
 
         while ((bytesRead = my_read(fd, buffer.data(), buffer.size())) > 0) {
-            std::string_view data(buffer.data(), bytesRead);
-            size_t start_pos = 0, end_pos;
-            while ((end_pos = data.find('\n', start_pos)) != std::string_view::npos) {
-                std::string line_str(data.substr(start_pos, end_pos - start_pos));
-                unique_lines.insert(line_str);
-                start_pos = end_pos + 1;
-            }
-            if (start_pos < data.size()) {
-                std::string line_str(data.substr(start_pos));
-                unique_lines.insert(line_str);
-            }
+            const char *tail = scan_lines(buffer.data(), bytesRead,
+                                          [&](const char *line, size_t length) {
+                                              if (carry.empty()) {
+                                                  insert({line, length});
+                                                  return;
+                                              }
+                                              carry.append(line, length);
+                                              insert(carry);
+                                              carry.clear();
+                                          });
+            carry.append(tail, buffer.data() + bytesRead - tail);
+        }
+        if (!carry.empty()) {
+            insert(carry);
         }
 
         if (bytesRead == -1) {
@@ -136,6 +238,7 @@ int main(int argc, char *argv[]) {
     cache_init_func cache_init = nullptr;
     cache_destroy_func cache_destroy = nullptr;
     bool verbose = false;
+    bool use_mmap = false;
 
 
     my_open_func my_open = ::open;
@@ -146,7 +249,7 @@ int main(int argc, char *argv[]) {
 
 
     if (argc < 2) {
-        std::cerr << "Использование: dedup <количество_итераций> [путь_к_cache.so] [-v]" << std::endl;
+        std::cerr << "Использование: dedup <количество_итераций> [путь_к_cache.so] [-v] [--mmap]" << std::endl;
         return 1;
     }
 
@@ -157,6 +260,8 @@ int main(int argc, char *argv[]) {
     for (int i = 2; i < argc; ++i) {
         if (std::string(argv[i]) == "-v") {
             verbose = true;
+        } else if (std::string(argv[i]) == "--mmap") {
+            use_mmap = true;
         } else {
             cache_library_path = argv[i];
         }
@@ -202,11 +307,13 @@ int main(int argc, char *argv[]) {
 
 
         std::cout << "Запуск с нашим кэшем..." << std::endl;
-        runDedup(num_iterations, input_filename, my_open, my_read, my_write, my_close, my_lseek, verbose);
+        runDedup(num_iterations, input_filename, my_open, my_read, my_write, my_close, my_lseek, verbose,
+                 use_mmap);
 
     } else {
         std::cout << "Запуск без кэша..." << std::endl;
-        runDedup(num_iterations, input_filename, ::open, ::read, ::write, ::close, ::lseek, verbose);
+        runDedup(num_iterations, input_filename, ::open, ::read, ::write, ::close, ::lseek, verbose,
+                 use_mmap);
     }
 
 
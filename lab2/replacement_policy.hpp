@@ -0,0 +1,265 @@
+#ifndef REPLACEMENT_POLICY_H
+#define REPLACEMENT_POLICY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace detail {
+
+    const uint32_t NO_BLOCK = UINT32_MAX;
+
+    // Doubly linked lists threaded through the slots of a fixed-size cache.
+    // A slot is on at most one list at a time; each list is a head (most
+    // recently added) and a tail.
+    class SlotLists {
+    public:
+        struct List {
+            uint32_t head = NO_BLOCK;
+            uint32_t tail = NO_BLOCK;
+            size_t size = 0;
+        };
+
+        explicit SlotLists(size_t slots) : prev_(slots, NO_BLOCK), next_(slots, NO_BLOCK) {}
+
+        void pushFront(List &list, uint32_t slot) {
+            prev_[slot] = NO_BLOCK;
+            next_[slot] = list.head;
+            if (list.head != NO_BLOCK) {
+                prev_[list.head] = slot;
+            } else {
+                list.tail = slot;
+            }
+            list.head = slot;
+            ++list.size;
+        }
+
+        void unlink(List &list, uint32_t slot) {
+            if (prev_[slot] != NO_BLOCK) {
+                next_[prev_[slot]] = next_[slot];
+            } else {
+                list.head = next_[slot];
+            }
+            if (next_[slot] != NO_BLOCK) {
+                prev_[next_[slot]] = prev_[slot];
+            } else {
+                list.tail = prev_[slot];
+            }
+            prev_[slot] = next_[slot] = NO_BLOCK;
+            --list.size;
+        }
+
+    private:
+        std::vector<uint32_t> prev_;
+        std::vector<uint32_t> next_;
+    };
+}
+
+// Decides which cached block to give up when the cache is full. Policies
+// work on slot numbers 0..slots-1 and keep their own per-slot state, so the
+// cache only reports events:
+//
+//   insert(slot, key)  a block was loaded into the free slot; key is a hash
+//                      of (file, block offset), for policies that remember
+//                      blocks after evicting them
+//   access(slot)       a cached block was referenced again
+//   victim()           picks the slot to evict; the cache then calls remove()
+//   remove(slot)       the block is gone, evicted or dropped on close
+//
+// None of them allocates after construction.
+class ReplacementPolicy {
+public:
+    virtual ~ReplacementPolicy() = default;
+
+    virtual void insert(uint32_t slot, uint64_t key) = 0;
+
+    virtual void access(uint32_t slot) = 0;
+
+    virtual uint32_t victim() = 0;
+
+    virtual void remove(uint32_t slot) = 0;
+
+    virtual const char *name() const = 0;
+};
+
+// Least recently used: a hit moves the block to the front, the back is
+// evicted. One pass over more blocks than fit replaces everything.
+class LruPolicy : public ReplacementPolicy {
+public:
+    explicit LruPolicy(size_t slots) : lists_(slots) {}
+
+    void insert(uint32_t slot, uint64_t) override { lists_.pushFront(lru_, slot); }
+
+    void access(uint32_t slot) override {
+        if (lru_.head != slot) {
+            lists_.unlink(lru_, slot);
+            lists_.pushFront(lru_, slot);
+        }
+    }
+
+    uint32_t victim() override { return lru_.tail; }
+
+    void remove(uint32_t slot) override { lists_.unlink(lru_, slot); }
+
+    const char *name() const override { return "lru"; }
+
+private:
+    detail::SlotLists lists_;
+    detail::SlotLists::List lru_;
+};
+
+// CLOCK (second chance): slots sit on a circle with a reference bit that a
+// hit sets. The hand clears set bits as it passes and stops at the first
+// clear one. A hit costs one store instead of two list splices.
+class ClockPolicy : public ReplacementPolicy {
+public:
+    explicit ClockPolicy(size_t slots) : state_(slots, EMPTY) {}
+
+    void insert(uint32_t slot, uint64_t) override { state_[slot] = REFERENCED; }
+
+    void access(uint32_t slot) override { state_[slot] = REFERENCED; }
+
+    uint32_t victim() override {
+        // Two sweeps clear every bit, so the loop ends unless all are empty.
+        for (size_t step = 0; step < 2 * state_.size() + 1; ++step) {
+            uint32_t slot = hand_;
+            hand_ = hand_ + 1 < state_.size() ? hand_ + 1 : 0;
+            if (state_[slot] == REFERENCED) {
+                state_[slot] = CACHED;
+            } else if (state_[slot] == CACHED) {
+                return slot;
+            }
+        }
+        return detail::NO_BLOCK;
+    }
+
+    void remove(uint32_t slot) override { state_[slot] = EMPTY; }
+
+    const char *name() const override { return "clock"; }
+
+private:
+    enum : uint8_t { EMPTY, CACHED, REFERENCED };
+
+    std::vector<uint8_t> state_;
+    uint32_t hand_ = 0;
+};
+
+// S3-FIFO (Yang et al., SOSP '23): new blocks enter a small FIFO holding a
+// tenth of the cache. A block that leaves it unreferenced is evicted at
+// once and its key goes to a ghost table; one that was hit moves to the
+// main FIFO. Blocks whose key is still a ghost go straight to the main FIFO.
+// The main FIFO gives blocks with hits another round (a 2-bit counter, so
+// up to three) before evicting them. A scan passes through the small FIFO
+// only and leaves the main FIFO, the working set, alone.
+//
+// The ghost table is direct mapped with one key per entry, sized to the
+// main FIFO: a colliding key overwrites the older one, which then just
+// counts as never seen.
+class S3FifoPolicy : public ReplacementPolicy {
+public:
+    explicit S3FifoPolicy(size_t slots)
+            : lists_(slots), where_(slots, NONE), freq_(slots, 0), key_(slots, 0),
+              small_target_(std::max<size_t>(slots / 10, 1)) {
+        size_t ghosts = 16;
+        while (ghosts < slots) {
+            ghosts *= 2;
+        }
+        ghosts_.assign(ghosts, 0);
+        ghost_mask_ = ghosts - 1;
+    }
+
+    void insert(uint32_t slot, uint64_t key) override {
+        key = key | 1;  // 0 marks an empty ghost entry
+        key_[slot] = key;
+        freq_[slot] = 0;
+        uint64_t &ghost = ghosts_[key & ghost_mask_];
+        if (ghost == key) {
+            ghost = 0;
+            where_[slot] = MAIN;
+            lists_.pushFront(main_, slot);
+        } else {
+            where_[slot] = SMALL;
+            lists_.pushFront(small_, slot);
+        }
+    }
+
+    void access(uint32_t slot) override {
+        if (freq_[slot] < 3) {
+            ++freq_[slot];
+        }
+    }
+
+    uint32_t victim() override {
+        for (;;) {
+            if (small_.size >= small_target_ || main_.size == 0) {
+                uint32_t slot = small_.tail;
+                if (slot == detail::NO_BLOCK) {
+                    return detail::NO_BLOCK;
+                }
+                if (freq_[slot] == 0) {
+                    ghosts_[key_[slot] & ghost_mask_] = key_[slot];
+                    return slot;
+                }
+                lists_.unlink(small_, slot);
+                freq_[slot] = 0;
+                where_[slot] = MAIN;
+                lists_.pushFront(main_, slot);
+            } else {
+                uint32_t slot = main_.tail;
+                if (freq_[slot] == 0) {
+                    return slot;
+                }
+                lists_.unlink(main_, slot);
+                --freq_[slot];
+                lists_.pushFront(main_, slot);
+            }
+        }
+    }
+
+    void remove(uint32_t slot) override {
+        if (where_[slot] == SMALL) {
+            lists_.unlink(small_, slot);
+        } else if (where_[slot] == MAIN) {
+            lists_.unlink(main_, slot);
+        }
+        where_[slot] = NONE;
+    }
+
+    const char *name() const override { return "s3fifo"; }
+
+private:
+    enum : uint8_t { NONE, SMALL, MAIN };
+
+    detail::SlotLists lists_;
+    detail::SlotLists::List small_;
+    detail::SlotLists::List main_;
+    std::vector<uint8_t> where_;
+    std::vector<uint8_t> freq_;
+    std::vector<uint64_t> key_;
+    size_t small_target_;
+    std::vector<uint64_t> ghosts_;
+    size_t ghost_mask_ = 0;
+};
+
+const char *const DEFAULT_REPLACEMENT_POLICY = "lru";
+
+// The policy called `name` ("lru", "clock" or "s3fifo") for `slots` slots,
+// or nullptr for an unknown name.
+inline std::unique_ptr<ReplacementPolicy> makeReplacementPolicy(const std::string &name,
+                                                                size_t slots) {
+    if (name == "lru") {
+        return std::make_unique<LruPolicy>(slots);
+    }
+    if (name == "clock") {
+        return std::make_unique<ClockPolicy>(slots);
+    }
+    if (name == "s3fifo") {
+        return std::make_unique<S3FifoPolicy>(slots);
+    }
+    return nullptr;
+}
+
+#endif